@@ -0,0 +1,383 @@
+#include "async_reader.hh"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#  define PSD_HAVE_IO_URING 1
+#  include <atomic>
+#  include <cerrno>
+#  include <cstring>
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#else
+#  define PSD_HAVE_IO_URING 0
+#endif
+
+/* Fallback: one thread serving reads in submission order with ByteSource::read_at(). */
+class ThreadReader : public AsyncReader {
+ public:
+  explicit ThreadReader(const ByteSource &source) : source_(source)
+  {
+    thread_ = std::thread([this] { thread_main(); });
+  }
+
+  ~ThreadReader() override
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      queue_.clear();
+    }
+    changed_.notify_all();
+    thread_.join();
+  }
+
+  const char *name() const override
+  {
+    return "thread";
+  }
+
+  void submit(uint64_t tag, uint64_t offset, size_t size, uint8_t *dst) override
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back({tag, offset, size, dst});
+    }
+    changed_.notify_all();
+  }
+
+  void wait(std::vector<uint64_t> &r_finished) override
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return !finished_.empty() || error_; });
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    r_finished.insert(r_finished.end(), finished_.begin(), finished_.end());
+    finished_.clear();
+  }
+
+ private:
+  struct Job {
+    uint64_t tag;
+    uint64_t offset;
+    size_t size;
+    uint8_t *dst;
+  };
+
+  void thread_main()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      changed_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      Job job = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        source_.read_at(job.offset, job.dst, job.size);
+      }
+      catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      if (error) {
+        error_ = error;
+      }
+      else {
+        finished_.push_back(job.tag);
+      }
+      changed_.notify_all();
+    }
+  }
+
+  const ByteSource &source_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<Job> queue_;
+  std::vector<uint64_t> finished_;
+  std::exception_ptr error_;
+  bool stopping_ = false;
+};
+
+#if PSD_HAVE_IO_URING
+
+/* Minimal io_uring client using the raw system calls, so there is no liburing dependency. Reads
+ * are IORING_OP_READV (Linux 5.1+); reads larger than MAX_PIECE or cut short are resubmitted for
+ * the remaining bytes. */
+class IOUringReader : public AsyncReader {
+ public:
+  static std::unique_ptr<AsyncReader> create(const ByteSource &source)
+  {
+    if (source.file_descriptor() < 0) {
+      return nullptr;
+    }
+    io_uring_params params = {};
+    int ring_fd = int(syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params));
+    if (ring_fd < 0) {
+      return nullptr;
+    }
+    std::unique_ptr<IOUringReader> reader(new IOUringReader(source, ring_fd));
+    if (!reader->map_rings(params)) {
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~IOUringReader() override
+  {
+    /* The kernel may still write into the destination buffers, let those reads finish. Failed
+     * reads still count as completed; if reaping itself fails (io_uring_enter errors) give up,
+     * closing the ring below cancels whatever is left. */
+    while (in_flight_ > 0) {
+      unsigned in_flight = in_flight_;
+      try {
+        reap(true);
+      }
+      catch (...) {
+        if (in_flight_ == in_flight) {
+          break;
+        }
+      }
+    }
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    close(ring_fd_);
+  }
+
+  const char *name() const override
+  {
+    return "io_uring";
+  }
+
+  void submit(uint64_t tag, uint64_t offset, size_t size, uint8_t *dst) override
+  {
+    if (size == 0) {
+      finished_.push_back(tag);
+      return;
+    }
+    while (free_requests_.empty()) {
+      reap(true);
+    }
+    uint32_t index = free_requests_.back();
+    free_requests_.pop_back();
+    requests_[index] = {tag, offset, size, dst, 0, {}};
+    queue_piece(index);
+  }
+
+  void wait(std::vector<uint64_t> &r_finished) override
+  {
+    while (finished_.empty() && in_flight_ > 0) {
+      reap(true);
+    }
+    if (finished_.empty()) {
+      reap(false);
+    }
+    r_finished.insert(r_finished.end(), finished_.begin(), finished_.end());
+    finished_.clear();
+  }
+
+ private:
+  static constexpr unsigned QUEUE_DEPTH = 64;
+  static constexpr size_t MAX_PIECE = size_t(1) << 30;
+
+  struct Request {
+    uint64_t tag;
+    uint64_t offset;
+    size_t size;
+    uint8_t *dst;
+    size_t done;
+    iovec iov;
+  };
+
+  IOUringReader(const ByteSource &source, int ring_fd) : source_(source), ring_fd_(ring_fd) {}
+
+  bool map_rings(const io_uring_params &params)
+  {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    void *sq = mmap(nullptr,
+                    sq_ring_size_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+      return false;
+    }
+    sq_ring_ = static_cast<uint8_t *>(sq);
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    }
+    else {
+      void *cq = mmap(nullptr,
+                      cq_ring_size_,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring_fd_,
+                      IORING_OFF_CQ_RING);
+      if (cq == MAP_FAILED) {
+        return false;
+      }
+      cq_ring_ = static_cast<uint8_t *>(cq);
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr,
+                      sqes_size_,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring_fd_,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    sq_tail_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq_ring_ + params.cq_off.cqes);
+
+    /* At most one piece of each request is in flight, so this also bounds the queues. */
+    requests_.resize(params.sq_entries);
+    for (uint32_t i = 0; i < params.sq_entries; i++) {
+      free_requests_.push_back(params.sq_entries - 1 - i);
+    }
+    return true;
+  }
+
+  void queue_piece(uint32_t index)
+  {
+    Request &request = requests_[index];
+    request.iov.iov_base = request.dst + request.done;
+    request.iov.iov_len = std::min(request.size - request.done, MAX_PIECE);
+
+    unsigned tail = *sq_tail_;
+    unsigned slot = tail & sq_mask_;
+    io_uring_sqe &sqe = sqes_[slot];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = source_.file_descriptor();
+    sqe.addr = reinterpret_cast<uint64_t>(&request.iov);
+    sqe.len = 1;
+    sqe.off = request.offset + request.done;
+    sqe.user_data = index;
+    sq_array_[slot] = slot;
+    std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+    pending_submit_++;
+    in_flight_++;
+  }
+
+  void enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+  {
+    while (true) {
+      long result = syscall(
+          __NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0);
+      if (result >= 0) {
+        pending_submit_ -= std::min(pending_submit_, unsigned(result));
+        return;
+      }
+      if (errno != EINTR) {
+        throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+      }
+    }
+  }
+
+  /* Submit queued pieces and process completions, waiting for at least one if `block`. */
+  void reap(bool block)
+  {
+    if (pending_submit_ > 0 || block) {
+      enter(pending_submit_, block ? 1 : 0, block ? IORING_ENTER_GETEVENTS : 0);
+    }
+    unsigned head = *cq_head_;
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+    std::exception_ptr error;
+    for (; head != tail; head++) {
+      const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      uint32_t index = uint32_t(cqe.user_data);
+      int result = cqe.res;
+      in_flight_--;
+      Request &request = requests_[index];
+      if (result <= 0) {
+        if (!error) {
+          error = result < 0 ? std::make_exception_ptr(std::system_error(
+                                   -result, std::generic_category(), "io_uring read")) :
+                               std::make_exception_ptr(UnexpectedEndOfFile());
+        }
+        free_requests_.push_back(index);
+        continue;
+      }
+      request.done += size_t(result);
+      if (request.done < request.size) {
+        queue_piece(index);
+        continue;
+      }
+      finished_.push_back(request.tag);
+      free_requests_.push_back(index);
+    }
+    std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  const ByteSource &source_;
+  int ring_fd_;
+  uint8_t *sq_ring_ = nullptr;
+  uint8_t *cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned pending_submit_ = 0;
+  unsigned in_flight_ = 0;
+  std::vector<Request> requests_;
+  std::vector<uint32_t> free_requests_;
+  std::vector<uint64_t> finished_;
+};
+
+#endif
+
+std::unique_ptr<AsyncReader> AsyncReader::create(const ByteSource &source)
+{
+#if PSD_HAVE_IO_URING
+  if (std::unique_ptr<AsyncReader> reader = IOUringReader::create(source)) {
+    return reader;
+  }
+#endif
+  return std::make_unique<ThreadReader>(source);
+}
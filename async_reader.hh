@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "byte_source.hh"
+
+/* Reads byte ranges of a ByteSource in the background. On Linux this uses io_uring when the
+ * kernel allows it, otherwise (and on other platforms) a dedicated reader thread. */
+class AsyncReader {
+ public:
+  static std::unique_ptr<AsyncReader> create(const ByteSource &source);
+  virtual ~AsyncReader() = default;
+
+  virtual const char *name() const = 0;
+
+  /* Start reading `size` bytes at `offset` into `dst`, which must stay valid until the read is
+   * reported by wait(). `tag` identifies the read. */
+  virtual void submit(uint64_t tag, uint64_t offset, size_t size, uint8_t *dst) = 0;
+
+  /* Block until at least one submitted read has finished and append the tags of all finished
+   * reads to `r_finished`. Throws on I/O errors and UnexpectedEndOfFile on short files. */
+  virtual void wait(std::vector<uint64_t> &r_finished) = 0;
+};
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "psd.hh"
+#include "thread_pool.hh"
+
+/* Parse many documents concurrently and report the throughput:
+ *
+ *   batch [-j threads] path...
+ *
+ * A path is a file, a directory (searched recursively for .psd and .psb files) or a pattern with
+ * `*` and `?` wildcards in any of its components, for shells that do not expand them. */
+
+namespace fs = std::filesystem;
+
+struct InputFile {
+  fs::path path;
+  uint64_t size;
+};
+
+static bool has_wildcards(const std::string &pattern)
+{
+  return pattern.find_first_of("*?") != std::string::npos;
+}
+
+/* `*` matches any run of characters and `?` any single one. */
+static bool wildcard_match(const char *pattern, const char *name)
+{
+  /* On a mismatch, retry from the last `*` with it covering one more character. */
+  const char *star = nullptr;
+  const char *star_name = nullptr;
+  while (*name) {
+    if (*pattern == '*') {
+      star = pattern++;
+      star_name = name;
+    }
+    else if (*pattern == '?' || *pattern == *name) {
+      pattern++;
+      name++;
+    }
+    else if (star) {
+      pattern = star + 1;
+      name = ++star_name;
+    }
+    else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
+
+static bool is_document(const fs::path &path)
+{
+  std::string extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+    return char(std::tolower(c));
+  });
+  return extension == ".psd" || extension == ".psb";
+}
+
+/* Returns false if there is nothing at `path`. */
+static bool add_path(const fs::path &path, std::vector<InputFile> &r_files)
+{
+  std::error_code error;
+  if (fs::is_directory(path, error)) {
+    for (const fs::directory_entry &entry : fs::recursive_directory_iterator(
+             path, fs::directory_options::skip_permission_denied, error))
+    {
+      if (entry.is_regular_file(error) && is_document(entry.path())) {
+        r_files.push_back({entry.path(), entry.file_size(error)});
+      }
+    }
+    return true;
+  }
+  if (fs::is_regular_file(path, error)) {
+    r_files.push_back({path, fs::file_size(path, error)});
+    return true;
+  }
+  std::cerr << path.string() << ": no such file or directory" << std::endl;
+  return false;
+}
+
+/* Expand the wildcards of the components in [it, end), appending them to `base`. */
+static void expand_pattern(const fs::path &base,
+                           fs::path::const_iterator it,
+                           fs::path::const_iterator end,
+                           std::vector<InputFile> &r_files)
+{
+  if (it == end) {
+    add_path(base, r_files);
+    return;
+  }
+  std::string component = it->string();
+  fs::path::const_iterator next = std::next(it);
+  if (!has_wildcards(component)) {
+    expand_pattern(base / *it, next, end, r_files);
+    return;
+  }
+
+  std::vector<fs::path> matches;
+  std::error_code error;
+  for (const fs::directory_entry &entry :
+       fs::directory_iterator(base.empty() ? fs::path(".") : base, error))
+  {
+    if (next != end && !entry.is_directory(error)) {
+      continue;
+    }
+    fs::path name = entry.path().filename();
+    if (wildcard_match(component.c_str(), name.string().c_str())) {
+      matches.push_back(base / name);
+    }
+  }
+  std::sort(matches.begin(), matches.end());
+  for (const fs::path &match : matches) {
+    expand_pattern(match, next, end, r_files);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  unsigned num_threads = 0;
+  std::vector<InputFile> files;
+  size_t num_missing = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = unsigned(std::atoi(argv[++i]));
+      continue;
+    }
+    fs::path path(argv[i]);
+    if (has_wildcards(argv[i])) {
+      expand_pattern({}, path.begin(), path.end(), files);
+    }
+    else if (!add_path(path, files)) {
+      num_missing++;
+    }
+  }
+  if (files.empty() && num_missing == 0) {
+    std::cerr << "usage: batch [-j threads] path..." << std::endl;
+    return 1;
+  }
+
+  /* Largest first, so the biggest documents do not start last and the small ones fill the gaps
+   * at the end. */
+  std::stable_sort(files.begin(), files.end(), [](const InputFile &a, const InputFile &b) {
+    return a.size > b.size;
+  });
+
+  ThreadPool thread_pool(num_threads);
+  std::atomic<uint64_t> num_bytes = 0;
+  std::atomic<size_t> num_failed = 0;
+  std::mutex output_mutex;
+  auto start = std::chrono::steady_clock::now();
+
+  /* One task per file. Each parse splits its channels (and merged image scanlines) into tasks on
+   * the same pool with nested parallel_for() calls, and workers that run out of files pick those
+   * up, so a single large document is spread over every thread once the others are done. */
+  thread_pool.parallel_for(files.size(), [&](size_t i) {
+    try {
+      ByteSource source(files[i].path);
+      ByteCursor in(source);
+      /* The whole document is allocated from this arena and freed with it. */
+      std::pmr::monotonic_buffer_resource arena;
+      PSDReadOptions options;
+      options.thread_pool = &thread_pool;
+      options.memory_resource = &arena;
+      PSDFile psd = read_psd(in, options);
+      num_bytes += source.size();
+    }
+    catch (const std::exception &e) {
+      num_failed++;
+      std::lock_guard<std::mutex> lock(output_mutex);
+      std::cerr << files[i].path.string() << ": " << e.what() << std::endl;
+    }
+  });
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  size_t num_parsed = files.size() - num_failed;
+  double megabytes = double(num_bytes) / (1024.0 * 1024.0);
+  std::cout << std::fixed << std::setprecision(2) << num_parsed << " files, " << megabytes
+            << " MB in " << seconds << " s on " << thread_pool.num_threads() << " threads: "
+            << double(num_parsed) / seconds << " files/s, " << megabytes / seconds << " MB/s"
+            << std::endl;
+  if (num_failed > 0) {
+    std::cout << num_failed << " files failed" << std::endl;
+  }
+  return num_failed > 0 || num_missing > 0 ? 1 : 0;
+}
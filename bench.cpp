@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#  include <malloc.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+#include "corpus.hh"
+#include "psd.hh"
+#include "thread_pool.hh"
+
+/* Parse and decode throughput over the synthetic corpus of corpus.hh:
+ *
+ *   bench [-r repetitions] [-j max_threads] [-l scan_layers] [document...]
+ *
+ * Documents are generated in memory and read from memory sources, so disk I/O is not measured.
+ * Every timing is the best of the repetitions (default 5). Sizes are of the input bytes, so MB/s
+ * of different stages can be compared. The thread sweep doubles the thread count up to
+ * `max_threads` (default: hardware threads). The layer scan compares LayerRecord and LayerTable
+ * over the layers of "many_layers" and over its records repeated to `scan_layers` (default
+ * 100000). Naming documents runs only those. */
+
+/* Every allocation made through operator new, which includes those of the default memory
+ * resource. */
+static std::atomic<uint64_t> num_allocations = 0;
+
+void *operator new(size_t size)
+{
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+/* std::pmr::new_delete_resource() allocates through these. */
+void *operator new(size_t size, std::align_val_t alignment)
+{
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t align = size_t(alignment);
+  size = std::max(align, (size + align - 1) / align * align);
+#ifdef _WIN32
+  void *ptr = _aligned_malloc(size, align);
+#else
+  void *ptr = std::aligned_alloc(align, size);
+#endif
+  if (ptr) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+  return operator new(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept
+{
+  operator delete(ptr, alignment);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+  operator delete(ptr, alignment);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t alignment) noexcept
+{
+  operator delete(ptr, alignment);
+}
+
+/* Peak resident set size in bytes, 0 where it is not available. */
+static uint64_t peak_rss()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#  ifdef __APPLE__
+  return uint64_t(usage.ru_maxrss);
+#  else
+  return uint64_t(usage.ru_maxrss) * 1024;
+#  endif
+#endif
+}
+
+template<typename Fn> static double best_seconds(int repetitions, Fn &&fn)
+{
+  double best = 1e300;
+  for (int i = 0; i < repetitions; i++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+static double megabytes(uint64_t bytes)
+{
+  return double(bytes) / (1024.0 * 1024.0);
+}
+
+struct Document {
+  CorpusDocumentSpec spec;
+  std::vector<uint8_t> bytes;
+};
+
+/* Time each section reader on its own, single threaded. */
+static void bench_sections(const Document &document, int repetitions)
+{
+  ByteSource source(std::span<const uint8_t>(document.bytes));
+  ByteCursor index_in(source);
+  FileHeader header;
+  PSDSectionIndex index = read_section_index(index_in, &header);
+
+  double header_seconds = best_seconds(repetitions, [&] {
+    ByteCursor in(source);
+    read_file_header(in);
+  });
+  double resources_seconds = best_seconds(repetitions, [&] {
+    ByteCursor in(source, index.color_mode_data.offset);
+    read_color_mode_data(in);
+    read_image_resources(in);
+  });
+
+  PSDReadOptions records_options;
+  records_options.skip_channel_data = true;
+  LayerMaskInfo records;
+  double records_seconds = best_seconds(repetitions, [&] {
+    ByteCursor in(source, index.layer_and_mask_info.offset);
+    records = read_layer_and_mask_info(in, header, records_options);
+  });
+
+  const LayerInfo &layers = records.layer_info;
+  uint64_t channel_bytes = 0;
+  for (const LayerRecord &record : layers.layer_records) {
+    for (const ChannelInfo &channel : record.channel_info) {
+      channel_bytes += channel.data_length;
+    }
+  }
+  double channels_seconds = best_seconds(repetitions, [&] {
+    size_t i = 0;
+    for (const LayerRecord &record : layers.layer_records) {
+      for (const ChannelInfo &channel : record.channel_info) {
+        ByteCursor in(source, layers.channel_offsets[i++]);
+        read_channel_image_data(
+            in, channel_rect(record, channel.id), channel.data_length, header);
+      }
+    }
+  });
+
+  double merged_seconds = best_seconds(repetitions, [&] {
+    ByteCursor in(source, index.image_data.offset);
+    read_image_data(in, header);
+  });
+
+  double psd_seconds = best_seconds(repetitions, [&] {
+    ByteCursor in(source);
+    read_psd(in);
+  });
+
+  /* Allocations of one parse, from the default resource and from an arena. */
+  uint64_t before = num_allocations;
+  {
+    ByteCursor in(source);
+    read_psd(in);
+  }
+  uint64_t default_allocations = num_allocations - before;
+  before = num_allocations;
+  {
+    std::pmr::monotonic_buffer_resource arena;
+    PSDReadOptions options;
+    options.memory_resource = &arena;
+    ByteCursor in(source);
+    read_psd(in, options);
+  }
+  uint64_t arena_allocations = num_allocations - before;
+
+  printf("%-18s %8.1f %8.2f %9.2f %9.1f %9.0f %9.0f %9.0f %9llu %7llu\n",
+         document.spec.name,
+         megabytes(document.bytes.size()),
+         header_seconds * 1e6,
+         resources_seconds * 1e6,
+         records_seconds * 1e6,
+         megabytes(channel_bytes) / channels_seconds,
+         megabytes(index.image_data.length) / merged_seconds,
+         megabytes(document.bytes.size()) / psd_seconds,
+         static_cast<unsigned long long>(default_allocations),
+         static_cast<unsigned long long>(arena_allocations));
+}
+
+/* Parse the whole corpus with read_psd() on pools of increasing size. */
+static void bench_threads(const std::vector<Document> &documents,
+                          int repetitions,
+                          unsigned max_threads)
+{
+  uint64_t total_bytes = 0;
+  for (const Document &document : documents) {
+    total_bytes += document.bytes.size();
+  }
+  printf("\n%-8s %10s %10s %8s\n", "threads", "files/s", "MB/s", "speedup");
+  double single_thread_seconds = 0;
+  for (unsigned num_threads = 1;; num_threads = std::min(num_threads * 2, max_threads)) {
+    ThreadPool thread_pool(num_threads);
+    double seconds = best_seconds(repetitions, [&] {
+      for (const Document &document : documents) {
+        ByteSource source(std::span<const uint8_t>(document.bytes));
+        ByteCursor in(source);
+        std::pmr::monotonic_buffer_resource arena;
+        PSDReadOptions options;
+        options.thread_pool = &thread_pool;
+        options.memory_resource = &arena;
+        read_psd(in, options);
+      }
+    });
+    if (num_threads == 1) {
+      single_thread_seconds = seconds;
+    }
+    printf("%-8u %10.1f %10.0f %8.2f\n",
+           num_threads,
+           double(documents.size()) / seconds,
+           megabytes(total_bytes) / seconds,
+           single_thread_seconds / seconds);
+    if (num_threads == max_threads) {
+      break;
+    }
+  }
+}
+
+/* Union of the visible layer rectangles, compared as signed like Rect::calc_intersection(). */
+struct Bounds {
+  int32_t top = INT32_MAX, left = INT32_MAX, bottom = INT32_MIN, right = INT32_MIN;
+
+  void add(const Rect &rect)
+  {
+    top = std::min(top, int32_t(rect.top));
+    left = std::min(left, int32_t(rect.left));
+    bottom = std::max(bottom, int32_t(rect.bottom));
+    right = std::max(right, int32_t(rect.right));
+  }
+
+  bool operator==(const Bounds &other) const = default;
+};
+
+/* Compare scans over every layer of a document reading LayerRecord (the array of structs) and
+ * LayerTable (the structure of arrays): the union of the visible bounds and the number of normal
+ * blend layers at full opacity. The records of `document` are repeated up to `num_layers`. */
+static void bench_layer_scan(const Document &document, int repetitions, uint32_t num_layers)
+{
+  ByteSource source(std::span<const uint8_t>(document.bytes));
+  ByteCursor in(source);
+  PSDReadOptions options;
+  options.skip_channel_data = true;
+  PSDFile psd = read_psd(in, options);
+  const std::pmr::vector<LayerRecord> &parsed = psd.layer_mask_info.layer_info.layer_records;
+  if (parsed.empty()) {
+    return;
+  }
+
+  printf("\n%-10s %10s %10s %10s %10s\n", "layers", "bounds", "bounds", "normal", "normal");
+  printf("%-10s %10s %10s %10s %10s\n", "", "records", "table", "records", "table");
+  printf("%-10s %10s %10s %10s %10s\n", "", "ns/layer", "ns/layer", "ns/layer", "ns/layer");
+  for (size_t count : {parsed.size(), size_t(num_layers)}) {
+    std::pmr::vector<LayerRecord> records;
+    records.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      records.push_back(parsed[i % parsed.size()]);
+    }
+    LayerTable table = make_layer_table(records);
+
+    Bounds records_bounds, table_bounds;
+    double records_bounds_seconds = best_seconds(repetitions, [&] {
+      Bounds bounds;
+      for (const LayerRecord &record : records) {
+        if ((record.flags & LAYER_FLAG_HIDDEN) == 0) {
+          bounds.add(record.rect);
+        }
+      }
+      records_bounds = bounds;
+    });
+    double table_bounds_seconds = best_seconds(repetitions, [&] {
+      Bounds bounds;
+      for (size_t i = 0; i < table.size(); i++) {
+        if (table.is_visible(i)) {
+          bounds.add(table.rects[i]);
+        }
+      }
+      table_bounds = bounds;
+    });
+
+    size_t records_normal = 0, table_normal = 0;
+    double records_normal_seconds = best_seconds(repetitions, [&] {
+      size_t normal = 0;
+      for (const LayerRecord &record : records) {
+        normal += memcmp(record.blend_mode_key, "norm", 4) == 0 && record.opacity == 255;
+      }
+      records_normal = normal;
+    });
+    double table_normal_seconds = best_seconds(repetitions, [&] {
+      size_t normal = 0;
+      for (size_t i = 0; i < table.size(); i++) {
+        normal += table.blend_modes[i] == fourcc("norm") && table.opacities[i] == 255;
+      }
+      table_normal = normal;
+    });
+
+    if (records_bounds != table_bounds || records_normal != table_normal) {
+      fprintf(stderr, "layer scans of %zu layers disagree\n", count);
+      exit(1);
+    }
+    double scale = 1e9 / double(count);
+    printf("%-10zu %10.2f %10.2f %10.2f %10.2f\n",
+           count,
+           records_bounds_seconds * scale,
+           table_bounds_seconds * scale,
+           records_normal_seconds * scale,
+           table_normal_seconds * scale);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int repetitions = 5;
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t scan_layers = 100000;
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repetitions = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      max_threads = unsigned(std::max(1, std::atoi(argv[++i])));
+    }
+    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      scan_layers = uint32_t(std::max(1, std::atoi(argv[++i])));
+    }
+    else {
+      names.push_back(argv[i]);
+    }
+  }
+
+  std::vector<Document> documents;
+  uint64_t corpus_bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const CorpusDocumentSpec &spec : default_corpus()) {
+    if (names.empty() || std::find(names.begin(), names.end(), spec.name) != names.end()) {
+      documents.push_back({spec, make_corpus_document(spec)});
+      corpus_bytes += documents.back().bytes.size();
+    }
+  }
+  if (documents.empty()) {
+    fprintf(stderr,
+            "usage: bench [-r repetitions] [-j max_threads] [-l scan_layers] [document...]\n");
+    return 1;
+  }
+  std::chrono::duration<double> generate_time = std::chrono::steady_clock::now() - start;
+  printf("%zu documents, %.1f MB, generated in %.2f s\n\n",
+         documents.size(),
+         megabytes(corpus_bytes),
+         generate_time.count());
+
+  printf("%-18s %8s %8s %9s %9s %9s %9s %9s %9s %7s\n",
+         "document",
+         "MB",
+         "header",
+         "resources",
+         "records",
+         "channels",
+         "merged",
+         "read_psd",
+         "allocs",
+         "arena");
+  printf("%-18s %8s %8s %9s %9s %9s %9s %9s %9s %7s\n",
+         "",
+         "",
+         "us",
+         "us",
+         "us",
+         "MB/s",
+         "MB/s",
+         "MB/s",
+         "",
+         "allocs");
+  for (const Document &document : documents) {
+    bench_sections(document, repetitions);
+  }
+
+  bench_threads(documents, repetitions, max_threads);
+
+  for (const Document &document : documents) {
+    if (strcmp(document.spec.name, "many_layers") == 0) {
+      bench_layer_scan(document, repetitions, scan_layers);
+    }
+  }
+
+  uint64_t rss = peak_rss();
+  if (rss > 0) {
+    printf("\npeak RSS %.1f MB, of which the corpus is %.1f MB\n",
+           megabytes(rss),
+           megabytes(corpus_bytes));
+  }
+  return 0;
+}
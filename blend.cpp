@@ -0,0 +1,388 @@
+#include "blend.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "psd.hh"
+
+/* Samples are blended as floats in [0, 1]. Every level evaluates the same operations in the same
+ * order, so they produce the same pixels. */
+static constexpr float UNIT = 1.0f / 255.0f;
+/* Lower bound of the result alpha used for un-premultiplying, where it is 0 the color terms are
+ * 0 as well. */
+static constexpr float MIN_ALPHA = 1e-6f;
+
+static uint8_t to_u8(float v)
+{
+  return uint8_t(std::clamp(int(std::nearbyint(v)), 0, 255));
+}
+
+static float hard_light_scalar(float cb, float cs)
+{
+  float cs2 = cs + cs;
+  float screen_s = cs2 - 1.0f;
+  return cs <= 0.5f ? cb * cs2 : (cb + screen_s) - cb * screen_s;
+}
+
+/* B(cb, cs) where `cb` is the canvas (backdrop) color and `cs` the layer (source) color. */
+template<BlendMode M> static float blend_scalar(float cb, float cs)
+{
+  if constexpr (M == BlendMode::Multiply) {
+    return cb * cs;
+  }
+  else if constexpr (M == BlendMode::Screen) {
+    return (cb + cs) - cb * cs;
+  }
+  else if constexpr (M == BlendMode::Overlay) {
+    return hard_light_scalar(cs, cb);
+  }
+  else if constexpr (M == BlendMode::Darken) {
+    return std::min(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Lighten) {
+    return std::max(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Difference) {
+    return std::fabs(cb - cs);
+  }
+  else if constexpr (M == BlendMode::Exclusion) {
+    float p = cb * cs;
+    return (cb + cs) - (p + p);
+  }
+  else if constexpr (M == BlendMode::HardLight) {
+    return hard_light_scalar(cb, cs);
+  }
+  else if constexpr (M == BlendMode::LinearDodge) {
+    return std::min(cb + cs, 1.0f);
+  }
+  else if constexpr (M == BlendMode::LinearBurn) {
+    return std::max((cb + cs) - 1.0f, 0.0f);
+  }
+  else {
+    return cs;
+  }
+}
+
+/* Source-over with the blend function mixed in:
+ *   ao = as + ab - as * ab
+ *   co = (as * (1 - ab) * cs + as * ab * B(cb, cs) + (1 - as) * ab * cb) / ao */
+template<BlendMode M>
+static void blend_span_scalar(uint8_t *const dst[4],
+                              const uint8_t *const src[4],
+                              uint8_t opacity,
+                              size_t begin,
+                              size_t count)
+{
+  const float src_alpha_scale = float(opacity) * (UNIT * UNIT);
+  for (size_t i = begin; i < count; i++) {
+    float as = float(src[3][i]) * src_alpha_scale;
+    float ab = float(dst[3][i]) * UNIT;
+    float ao = (as + ab) - as * ab;
+    float inv_ao = 1.0f / std::max(ao, MIN_ALPHA);
+    float w_s = as * (1.0f - ab), w_sb = as * ab, w_b = (1.0f - as) * ab;
+    for (int c = 0; c < 3; c++) {
+      float cb = float(dst[c][i]) * UNIT;
+      float cs = float(src[c][i]) * UNIT;
+      float co = ((w_s * cs + w_sb * blend_scalar<M>(cb, cs)) + w_b * cb) * inv_ao;
+      dst[c][i] = to_u8(co * 255.0f);
+    }
+    dst[3][i] = to_u8(ao * 255.0f);
+  }
+}
+
+template<BlendMode M>
+static void blend_span_scalar(uint8_t *const dst[4],
+                              const uint8_t *const src[4],
+                              uint8_t opacity,
+                              size_t count)
+{
+  blend_span_scalar<M>(dst, src, opacity, 0, count);
+}
+
+#if PSD_SIMD_X86
+
+static __m128 load_u8x4_ps(const uint8_t *src)
+{
+  int32_t bytes;
+  memcpy(&bytes, src, 4);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+static void store_ps_u8x4(uint8_t *dst, __m128 v)
+{
+  __m128i i = _mm_cvtps_epi32(v);
+  i = _mm_packs_epi32(i, i);
+  i = _mm_packus_epi16(i, i);
+  int32_t bytes = _mm_cvtsi128_si32(i);
+  memcpy(dst, &bytes, 4);
+}
+
+static __m128 hard_light_sse2(__m128 cb, __m128 cs)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128 cs2 = _mm_add_ps(cs, cs);
+  __m128 screen_s = _mm_sub_ps(cs2, one);
+  __m128 low = _mm_mul_ps(cb, cs2);
+  __m128 high = _mm_sub_ps(_mm_add_ps(cb, screen_s), _mm_mul_ps(cb, screen_s));
+  __m128 is_low = _mm_cmple_ps(cs, _mm_set1_ps(0.5f));
+  return _mm_or_ps(_mm_and_ps(is_low, low), _mm_andnot_ps(is_low, high));
+}
+
+template<BlendMode M> static __m128 blend_sse2(__m128 cb, __m128 cs)
+{
+  if constexpr (M == BlendMode::Multiply) {
+    return _mm_mul_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Screen) {
+    return _mm_sub_ps(_mm_add_ps(cb, cs), _mm_mul_ps(cb, cs));
+  }
+  else if constexpr (M == BlendMode::Overlay) {
+    return hard_light_sse2(cs, cb);
+  }
+  else if constexpr (M == BlendMode::Darken) {
+    return _mm_min_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Lighten) {
+    return _mm_max_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Difference) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(cb, cs));
+  }
+  else if constexpr (M == BlendMode::Exclusion) {
+    __m128 p = _mm_mul_ps(cb, cs);
+    return _mm_sub_ps(_mm_add_ps(cb, cs), _mm_add_ps(p, p));
+  }
+  else if constexpr (M == BlendMode::HardLight) {
+    return hard_light_sse2(cb, cs);
+  }
+  else if constexpr (M == BlendMode::LinearDodge) {
+    return _mm_min_ps(_mm_add_ps(cb, cs), _mm_set1_ps(1.0f));
+  }
+  else if constexpr (M == BlendMode::LinearBurn) {
+    return _mm_max_ps(_mm_sub_ps(_mm_add_ps(cb, cs), _mm_set1_ps(1.0f)), _mm_setzero_ps());
+  }
+  else {
+    return cs;
+  }
+}
+
+template<BlendMode M>
+static void blend_span_sse2(uint8_t *const dst[4],
+                            const uint8_t *const src[4],
+                            uint8_t opacity,
+                            size_t count)
+{
+  const __m128 unit = _mm_set1_ps(UNIT);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(255.0f);
+  const __m128 min_alpha = _mm_set1_ps(MIN_ALPHA);
+  const __m128 src_alpha_scale = _mm_set1_ps(float(opacity) * (UNIT * UNIT));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 as = _mm_mul_ps(load_u8x4_ps(src[3] + i), src_alpha_scale);
+    __m128 ab = _mm_mul_ps(load_u8x4_ps(dst[3] + i), unit);
+    __m128 ao = _mm_sub_ps(_mm_add_ps(as, ab), _mm_mul_ps(as, ab));
+    __m128 inv_ao = _mm_div_ps(one, _mm_max_ps(ao, min_alpha));
+    __m128 w_s = _mm_mul_ps(as, _mm_sub_ps(one, ab));
+    __m128 w_sb = _mm_mul_ps(as, ab);
+    __m128 w_b = _mm_mul_ps(_mm_sub_ps(one, as), ab);
+    for (int c = 0; c < 3; c++) {
+      __m128 cb = _mm_mul_ps(load_u8x4_ps(dst[c] + i), unit);
+      __m128 cs = _mm_mul_ps(load_u8x4_ps(src[c] + i), unit);
+      __m128 co = _mm_add_ps(_mm_mul_ps(w_s, cs), _mm_mul_ps(w_sb, blend_sse2<M>(cb, cs)));
+      co = _mm_mul_ps(_mm_add_ps(co, _mm_mul_ps(w_b, cb)), inv_ao);
+      store_ps_u8x4(dst[c] + i, _mm_mul_ps(co, scale));
+    }
+    store_ps_u8x4(dst[3] + i, _mm_mul_ps(ao, scale));
+  }
+  blend_span_scalar<M>(dst, src, opacity, i, count);
+}
+
+PSD_TARGET_AVX2 static __m256 load_u8x8_ps(const uint8_t *src)
+{
+  __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src));
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+PSD_TARGET_AVX2 static void store_ps_u8x8(uint8_t *dst, __m256 v)
+{
+  __m256i i = _mm256_cvtps_epi32(v);
+  __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(packed, packed));
+}
+
+PSD_TARGET_AVX2 static __m256 hard_light_avx2(__m256 cb, __m256 cs)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  __m256 cs2 = _mm256_add_ps(cs, cs);
+  __m256 screen_s = _mm256_sub_ps(cs2, one);
+  __m256 low = _mm256_mul_ps(cb, cs2);
+  __m256 high = _mm256_sub_ps(_mm256_add_ps(cb, screen_s), _mm256_mul_ps(cb, screen_s));
+  __m256 is_low = _mm256_cmp_ps(cs, _mm256_set1_ps(0.5f), _CMP_LE_OQ);
+  return _mm256_blendv_ps(high, low, is_low);
+}
+
+template<BlendMode M> PSD_TARGET_AVX2 static __m256 blend_avx2(__m256 cb, __m256 cs)
+{
+  if constexpr (M == BlendMode::Multiply) {
+    return _mm256_mul_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Screen) {
+    return _mm256_sub_ps(_mm256_add_ps(cb, cs), _mm256_mul_ps(cb, cs));
+  }
+  else if constexpr (M == BlendMode::Overlay) {
+    return hard_light_avx2(cs, cb);
+  }
+  else if constexpr (M == BlendMode::Darken) {
+    return _mm256_min_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Lighten) {
+    return _mm256_max_ps(cb, cs);
+  }
+  else if constexpr (M == BlendMode::Difference) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(cb, cs));
+  }
+  else if constexpr (M == BlendMode::Exclusion) {
+    __m256 p = _mm256_mul_ps(cb, cs);
+    return _mm256_sub_ps(_mm256_add_ps(cb, cs), _mm256_add_ps(p, p));
+  }
+  else if constexpr (M == BlendMode::HardLight) {
+    return hard_light_avx2(cb, cs);
+  }
+  else if constexpr (M == BlendMode::LinearDodge) {
+    return _mm256_min_ps(_mm256_add_ps(cb, cs), _mm256_set1_ps(1.0f));
+  }
+  else if constexpr (M == BlendMode::LinearBurn) {
+    __m256 sum = _mm256_sub_ps(_mm256_add_ps(cb, cs), _mm256_set1_ps(1.0f));
+    return _mm256_max_ps(sum, _mm256_setzero_ps());
+  }
+  else {
+    return cs;
+  }
+}
+
+template<BlendMode M>
+PSD_TARGET_AVX2 static void blend_span_avx2(uint8_t *const dst[4],
+                                            const uint8_t *const src[4],
+                                            uint8_t opacity,
+                                            size_t count)
+{
+  const __m256 unit = _mm256_set1_ps(UNIT);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 scale = _mm256_set1_ps(255.0f);
+  const __m256 min_alpha = _mm256_set1_ps(MIN_ALPHA);
+  const __m256 src_alpha_scale = _mm256_set1_ps(float(opacity) * (UNIT * UNIT));
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 as = _mm256_mul_ps(load_u8x8_ps(src[3] + i), src_alpha_scale);
+    __m256 ab = _mm256_mul_ps(load_u8x8_ps(dst[3] + i), unit);
+    __m256 ao = _mm256_sub_ps(_mm256_add_ps(as, ab), _mm256_mul_ps(as, ab));
+    __m256 inv_ao = _mm256_div_ps(one, _mm256_max_ps(ao, min_alpha));
+    __m256 w_s = _mm256_mul_ps(as, _mm256_sub_ps(one, ab));
+    __m256 w_sb = _mm256_mul_ps(as, ab);
+    __m256 w_b = _mm256_mul_ps(_mm256_sub_ps(one, as), ab);
+    for (int c = 0; c < 3; c++) {
+      __m256 cb = _mm256_mul_ps(load_u8x8_ps(dst[c] + i), unit);
+      __m256 cs = _mm256_mul_ps(load_u8x8_ps(src[c] + i), unit);
+      __m256 co = _mm256_add_ps(_mm256_mul_ps(w_s, cs),
+                                _mm256_mul_ps(w_sb, blend_avx2<M>(cb, cs)));
+      co = _mm256_mul_ps(_mm256_add_ps(co, _mm256_mul_ps(w_b, cb)), inv_ao);
+      store_ps_u8x8(dst[c] + i, _mm256_mul_ps(co, scale));
+    }
+    store_ps_u8x8(dst[3] + i, _mm256_mul_ps(ao, scale));
+  }
+  blend_span_scalar<M>(dst, src, opacity, i, count);
+}
+
+#endif
+
+template<BlendMode M> static BlendSpanFunction blend_span_function_for_level(SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    return blend_span_avx2<M>;
+  }
+  if (level == SIMDLevel::SSE2) {
+    return blend_span_sse2<M>;
+  }
+#endif
+  return blend_span_scalar<M>;
+}
+
+bool blend_mode_from_key(uint32_t key, BlendMode *r_mode)
+{
+  switch (key) {
+    case fourcc("norm"):
+    case fourcc("pass"):
+      *r_mode = BlendMode::Normal;
+      return true;
+    case fourcc("mul "):
+      *r_mode = BlendMode::Multiply;
+      return true;
+    case fourcc("scrn"):
+      *r_mode = BlendMode::Screen;
+      return true;
+    case fourcc("over"):
+      *r_mode = BlendMode::Overlay;
+      return true;
+    case fourcc("dark"):
+      *r_mode = BlendMode::Darken;
+      return true;
+    case fourcc("lite"):
+      *r_mode = BlendMode::Lighten;
+      return true;
+    case fourcc("diff"):
+      *r_mode = BlendMode::Difference;
+      return true;
+    case fourcc("smud"):
+      *r_mode = BlendMode::Exclusion;
+      return true;
+    case fourcc("hLit"):
+      *r_mode = BlendMode::HardLight;
+      return true;
+    case fourcc("lddg"):
+      *r_mode = BlendMode::LinearDodge;
+      return true;
+    case fourcc("lbrn"):
+      *r_mode = BlendMode::LinearBurn;
+      return true;
+  }
+  return false;
+}
+
+BlendSpanFunction blend_span_function(BlendMode mode, SIMDLevel level)
+{
+  switch (mode) {
+    case BlendMode::Normal:
+      break;
+    case BlendMode::Multiply:
+      return blend_span_function_for_level<BlendMode::Multiply>(level);
+    case BlendMode::Screen:
+      return blend_span_function_for_level<BlendMode::Screen>(level);
+    case BlendMode::Overlay:
+      return blend_span_function_for_level<BlendMode::Overlay>(level);
+    case BlendMode::Darken:
+      return blend_span_function_for_level<BlendMode::Darken>(level);
+    case BlendMode::Lighten:
+      return blend_span_function_for_level<BlendMode::Lighten>(level);
+    case BlendMode::Difference:
+      return blend_span_function_for_level<BlendMode::Difference>(level);
+    case BlendMode::Exclusion:
+      return blend_span_function_for_level<BlendMode::Exclusion>(level);
+    case BlendMode::HardLight:
+      return blend_span_function_for_level<BlendMode::HardLight>(level);
+    case BlendMode::LinearDodge:
+      return blend_span_function_for_level<BlendMode::LinearDodge>(level);
+    case BlendMode::LinearBurn:
+      return blend_span_function_for_level<BlendMode::LinearBurn>(level);
+  }
+  return blend_span_function_for_level<BlendMode::Normal>(level);
+}
+
+BlendSpanFunction blend_span_function(BlendMode mode)
+{
+  return blend_span_function(mode, simd_level());
+}
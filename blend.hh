@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hh"
+
+/* Separable blend modes, named after Photoshop. The formulas are the ones of the W3C compositing
+ * specification. */
+enum class BlendMode {
+  Normal,
+  Multiply,
+  Screen,
+  Overlay,
+  Darken,
+  Lighten,
+  Difference,
+  Exclusion,
+  HardLight,
+  LinearDodge,
+  LinearBurn,
+};
+
+/* Map a LayerRecord::blend_mode_key given as fourcc() to a mode. Returns false for keys without a
+ * kernel. Pass-through (used by groups) maps to Normal. */
+bool blend_mode_from_key(uint32_t key, BlendMode *r_mode);
+
+/* Composite `count` pixels of a layer onto the canvas. `dst` and `src` are the R, G, B and A
+ * planes of the canvas and of the layer, both with straight (not premultiplied) alpha, and
+ * `opacity` scales the layer alpha. The source color planes may alias each other. */
+using BlendSpanFunction = void (*)(uint8_t *const dst[4],
+                                   const uint8_t *const src[4],
+                                   uint8_t opacity,
+                                   size_t count);
+
+/* Look the kernel up once per layer, not per pixel. */
+BlendSpanFunction blend_span_function(BlendMode mode);
+BlendSpanFunction blend_span_function(BlendMode mode, SIMDLevel level);
@@ -0,0 +1,339 @@
+#include "byte_source.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+/* Size of the refill buffer used when the source is not memory mapped. */
+static constexpr size_t READ_BUFFER_SIZE = 1 << 20;
+
+#ifdef _WIN32
+
+ByteSource::ByteSource(const std::filesystem::path &path)
+{
+  HANDLE file = CreateFileW(path.c_str(),
+                            GENERIC_READ,
+                            FILE_SHARE_READ,
+                            nullptr,
+                            OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw std::system_error(
+        static_cast<int>(GetLastError()), std::system_category(), path.string());
+  }
+  file_handle_ = file;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    throw std::system_error(
+        static_cast<int>(GetLastError()), std::system_category(), path.string());
+  }
+  size_ = static_cast<uint64_t>(size.QuadPart);
+  if (size_ == 0) {
+    return;
+  }
+
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    return;
+  }
+  void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (data == nullptr) {
+    CloseHandle(mapping);
+    return;
+  }
+  mapping_handle_ = mapping;
+  mapped_data_ = static_cast<const uint8_t *>(data);
+}
+
+ByteSource::~ByteSource()
+{
+  if (mapped_data_ != nullptr && owns_mapping_) {
+    UnmapViewOfFile(mapped_data_);
+  }
+  if (mapping_handle_ != nullptr) {
+    CloseHandle(static_cast<HANDLE>(mapping_handle_));
+  }
+  if (file_handle_ != nullptr) {
+    CloseHandle(static_cast<HANDLE>(file_handle_));
+  }
+}
+
+void ByteSource::read_at(uint64_t offset, void *dst, size_t size) const
+{
+  if (offset > size_ || size > size_ - offset) {
+    throw UnexpectedEndOfFile();
+  }
+  if (mapped_data_ != nullptr) {
+    memcpy(dst, mapped_data_ + offset, size);
+    return;
+  }
+  uint8_t *out = static_cast<uint8_t *>(dst);
+  while (size > 0) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+    DWORD num_read = 0;
+    if (!ReadFile(static_cast<HANDLE>(file_handle_), out, chunk, &num_read, &overlapped)) {
+      throw std::system_error(static_cast<int>(GetLastError()), std::system_category());
+    }
+    if (num_read == 0) {
+      throw UnexpectedEndOfFile();
+    }
+    out += num_read;
+    offset += num_read;
+    size -= num_read;
+  }
+}
+
+#else
+
+ByteSource::ByteSource(const std::filesystem::path &path)
+{
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(), path.string());
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    int error = errno;
+    close(fd_);
+    throw std::system_error(error, std::generic_category(), path.string());
+  }
+  size_ = static_cast<uint64_t>(st.st_size);
+  if (size_ == 0) {
+    return;
+  }
+
+  void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (data != MAP_FAILED) {
+    mapped_data_ = static_cast<const uint8_t *>(data);
+  }
+}
+
+ByteSource::~ByteSource()
+{
+  if (mapped_data_ != nullptr && owns_mapping_) {
+    munmap(const_cast<uint8_t *>(mapped_data_), size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void ByteSource::read_at(uint64_t offset, void *dst, size_t size) const
+{
+  if (offset > size_ || size > size_ - offset) {
+    throw UnexpectedEndOfFile();
+  }
+  if (mapped_data_ != nullptr) {
+    memcpy(dst, mapped_data_ + offset, size);
+    return;
+  }
+  uint8_t *out = static_cast<uint8_t *>(dst);
+  while (size > 0) {
+    ssize_t num_read = pread(fd_, out, size, static_cast<off_t>(offset));
+    if (num_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category());
+    }
+    if (num_read == 0) {
+      throw UnexpectedEndOfFile();
+    }
+    out += num_read;
+    offset += static_cast<uint64_t>(num_read);
+    size -= static_cast<size_t>(num_read);
+  }
+}
+
+#endif
+
+ByteSource::ByteSource(std::span<const uint8_t> memory)
+    : size_(memory.size()), mapped_data_(memory.data()), owns_mapping_(false)
+{
+}
+
+Payload Payload::view(std::span<const char> bytes, std::pmr::memory_resource *resource)
+{
+  Payload payload(resource);
+  payload.data_ = bytes.data();
+  payload.size_ = bytes.size();
+  return payload;
+}
+
+Payload Payload::copy(std::span<const char> bytes, std::pmr::memory_resource *resource)
+{
+  return adopt(std::pmr::vector<char>(bytes.begin(), bytes.end(), resource));
+}
+
+Payload Payload::adopt(std::pmr::vector<char> &&bytes)
+{
+  Payload payload(bytes.get_allocator().resource());
+  payload.owned_ = std::move(bytes);
+  payload.data_ = payload.owned_.data();
+  payload.size_ = payload.owned_.size();
+  return payload;
+}
+
+Payload::Payload(const Payload &other) : size_(other.size_), owned_(other.owned_)
+{
+  data_ = other.is_view() ? other.data_ : owned_.data();
+}
+
+Payload::Payload(Payload &&other) noexcept
+    : data_(other.data_), size_(other.size_), owned_(std::move(other.owned_))
+{
+  /* Moving a vector keeps its buffer, so `data_` stays valid for owned payloads. */
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+Payload &Payload::operator=(const Payload &other)
+{
+  if (this != &other) {
+    owned_ = other.owned_;
+    size_ = other.size_;
+    data_ = other.is_view() ? other.data_ : owned_.data();
+  }
+  return *this;
+}
+
+Payload &Payload::operator=(Payload &&other)
+{
+  if (this != &other) {
+    bool other_is_view = other.is_view();
+    /* With different memory resources the bytes are copied rather than moved, so `data_` has to
+     * be taken from `owned_` afterwards. */
+    owned_ = std::move(other.owned_);
+    data_ = other_is_view ? other.data_ : owned_.data();
+    size_ = other.size_;
+    other.owned_.clear();
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void Payload::detach()
+{
+  if (is_view()) {
+    *this = copy(span(), owned_.get_allocator().resource());
+  }
+}
+
+ByteCursor::ByteCursor(const ByteSource &source, uint64_t offset) : source_(&source)
+{
+  seek(offset);
+}
+
+ByteCursor::ByteCursor(const ByteCursor &other) : source_(other.source_)
+{
+  seek(other.tell());
+}
+
+ByteCursor &ByteCursor::operator=(const ByteCursor &other)
+{
+  if (this != &other) {
+    source_ = other.source_;
+    seek(other.tell());
+  }
+  return *this;
+}
+
+Payload ByteCursor::read_payload(size_t size, std::pmr::memory_resource *resource)
+{
+  if (source_->is_mapped()) {
+    return Payload::view({reinterpret_cast<const char *>(consume(size)), size}, resource);
+  }
+  std::pmr::vector<char> bytes(size, resource);
+  read(bytes.data(), size);
+  return Payload::adopt(std::move(bytes));
+}
+
+void ByteCursor::set_window(uint64_t offset, const uint8_t *begin, size_t size)
+{
+  window_offset_ = offset;
+  window_begin_ = begin;
+  cur_ = begin;
+  end_ = begin + size;
+}
+
+void ByteCursor::seek(uint64_t offset)
+{
+  if (offset > source_->size()) {
+    throw UnexpectedEndOfFile();
+  }
+  if (source_->is_mapped()) {
+    set_window(0, source_->mapped_data(), source_->size());
+    cur_ = window_begin_ + offset;
+    return;
+  }
+  if (offset >= window_offset_ &&
+      offset - window_offset_ <= static_cast<uint64_t>(end_ - window_begin_))
+  {
+    cur_ = window_begin_ + (offset - window_offset_);
+    return;
+  }
+  /* Empty window, the next read refills from `offset`. */
+  set_window(offset, buffer_.data(), 0);
+}
+
+void ByteCursor::refill(size_t min_size)
+{
+  uint64_t offset = tell();
+  uint64_t available = source_->size() - offset;
+  if (source_->is_mapped() || available < min_size) {
+    throw UnexpectedEndOfFile();
+  }
+  size_t size = static_cast<size_t>(
+      std::min<uint64_t>(std::max(READ_BUFFER_SIZE, min_size), available));
+  if (buffer_.size() < size) {
+    buffer_.resize(std::max(size, READ_BUFFER_SIZE));
+  }
+  source_->read_at(offset, buffer_.data(), size);
+  set_window(offset, buffer_.data(), size);
+}
+
+void ByteCursor::read_slow(void *dst, size_t size)
+{
+  if (source_->is_mapped()) {
+    throw UnexpectedEndOfFile();
+  }
+  uint8_t *out = static_cast<uint8_t *>(dst);
+  size_t buffered = static_cast<size_t>(end_ - cur_);
+  if (buffered > 0) {
+    memcpy(out, cur_, buffered);
+    cur_ += buffered;
+    out += buffered;
+    size -= buffered;
+  }
+
+  if (size >= READ_BUFFER_SIZE) {
+    /* Large reads bypass the buffer. */
+    uint64_t offset = tell();
+    source_->read_at(offset, out, size);
+    set_window(offset + size, buffer_.data(), 0);
+    return;
+  }
+  refill(size);
+  memcpy(out, cur_, size);
+  cur_ += size;
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+#include "byteswap.hh"
+
+class UnexpectedEndOfFile : public std::exception {
+ public:
+  const char *what() const throw()
+  {
+    return "Unexpected end of file";
+  }
+};
+
+/* Read-only view of a whole file. The file is memory mapped when possible, otherwise reads are
+ * served with positional reads (pread), so a single source can be shared by several cursors. */
+class ByteSource {
+ public:
+  explicit ByteSource(const std::filesystem::path &path);
+  /* Source over bytes already in memory, which must outlive it. Behaves like a mapped file. */
+  explicit ByteSource(std::span<const uint8_t> memory);
+  ~ByteSource();
+
+  ByteSource(const ByteSource &) = delete;
+  ByteSource &operator=(const ByteSource &) = delete;
+
+  uint64_t size() const
+  {
+    return size_;
+  }
+
+  bool is_mapped() const
+  {
+    return mapped_data_ != nullptr;
+  }
+
+  /* Start of the mapping, nullptr when the file could not be mapped. */
+  const uint8_t *mapped_data() const
+  {
+    return mapped_data_;
+  }
+
+  /* Copy `size` bytes starting at `offset` into `dst`, safe to call from multiple threads. */
+  void read_at(uint64_t offset, void *dst, size_t size) const;
+
+#ifndef _WIN32
+  /* The open file, -1 for memory sources. */
+  int file_descriptor() const
+  {
+    return fd_;
+  }
+#endif
+
+ private:
+#ifdef _WIN32
+  void *file_handle_ = nullptr;
+  void *mapping_handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+  uint64_t size_ = 0;
+  const uint8_t *mapped_data_ = nullptr;
+  bool owns_mapping_ = true;
+};
+
+/* Bytes of a payload inside a file. Payloads read from a mapped source are views into the
+ * mapping and are only valid while the ByteSource is alive; detach() turns a view into an owned
+ * copy. Payloads read from an unmapped source always own their bytes. Owned bytes come from the
+ * memory resource the payload was created with, which detach() also uses. */
+class Payload {
+ public:
+  explicit Payload(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : owned_(resource)
+  {
+  }
+  static Payload view(std::span<const char> bytes,
+                      std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+  static Payload copy(std::span<const char> bytes,
+                      std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+  static Payload adopt(std::pmr::vector<char> &&bytes);
+
+  Payload(const Payload &other);
+  Payload(Payload &&other) noexcept;
+  Payload &operator=(const Payload &other);
+  Payload &operator=(Payload &&other);
+
+  const char *data() const
+  {
+    return data_;
+  }
+
+  size_t size() const
+  {
+    return size_;
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  const char *begin() const
+  {
+    return data_;
+  }
+
+  const char *end() const
+  {
+    return data_ + size_;
+  }
+
+  std::span<const char> span() const
+  {
+    return {data_, size_};
+  }
+
+  bool is_view() const
+  {
+    return size_ > 0 && data_ != owned_.data();
+  }
+
+  /* Make an owned copy of the bytes if this is a view, so it outlives the source. */
+  void detach();
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  std::pmr::vector<char> owned_;
+};
+
+/* Sequential reader over a ByteSource. Reads are served from a window, which is the whole mapping
+ * for mapped sources and a refillable buffer otherwise, so the common case is a bounds check
+ * followed by a load. */
+class ByteCursor {
+ public:
+  explicit ByteCursor(const ByteSource &source, uint64_t offset = 0);
+
+  ByteCursor(const ByteCursor &other);
+  ByteCursor &operator=(const ByteCursor &other);
+
+  const ByteSource &source() const
+  {
+    return *source_;
+  }
+
+  uint64_t tell() const
+  {
+    return window_offset_ + static_cast<uint64_t>(cur_ - window_begin_);
+  }
+
+  void seek(uint64_t offset);
+
+  void skip(uint64_t size)
+  {
+    seek(tell() + size);
+  }
+
+  void read(void *dst, size_t size)
+  {
+    if (static_cast<size_t>(end_ - cur_) >= size) {
+      memcpy(dst, cur_, size);
+      cur_ += size;
+      return;
+    }
+    read_slow(dst, size);
+  }
+
+  void peek(void *dst, size_t size)
+  {
+    ensure(size);
+    memcpy(dst, cur_, size);
+  }
+
+  template<typename T> T read_be()
+  {
+    return load_be<T>(consume(sizeof(T)));
+  }
+
+  /* Read `count` big-endian values into `dst` with a single bounds check. */
+  void read_be_array(uint16_t *dst, size_t count)
+  {
+    be_to_native_u16(dst, consume(count * 2), count);
+  }
+
+  void read_be_array(uint32_t *dst, size_t count)
+  {
+    be_to_native_u32(dst, consume(count * 4), count);
+  }
+
+  /* Read `size` bytes as a view into the mapping, or as a copy allocated from `resource` when the
+   * source is not mapped. */
+  Payload read_payload(size_t size,
+                       std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+  /* Advance by `size` bytes and return a pointer to them. The pointer stays valid until the next
+   * call on this cursor (for the lifetime of the source when it is mapped). */
+  const uint8_t *consume(size_t size)
+  {
+    ensure(size);
+    const uint8_t *data = cur_;
+    cur_ += size;
+    return data;
+  }
+
+ private:
+  void ensure(size_t size)
+  {
+    if (static_cast<size_t>(end_ - cur_) < size) {
+      refill(size);
+    }
+  }
+
+  void refill(size_t min_size);
+  void read_slow(void *dst, size_t size);
+  void set_window(uint64_t offset, const uint8_t *begin, size_t size);
+
+  const ByteSource *source_;
+  uint64_t window_offset_ = 0;
+  const uint8_t *window_begin_ = nullptr;
+  const uint8_t *cur_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  /* Only used when the source is not mapped. */
+  std::vector<uint8_t> buffer_;
+};
@@ -0,0 +1,187 @@
+#include "byte_writer.hh"
+#include "byte_source.hh"
+#include "psd.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#ifdef __linux__
+#  include <unistd.h>
+#endif
+
+ByteWriter::ByteWriter(std::vector<uint8_t> &out) : out_(out)
+{
+}
+
+ByteWriter::ByteWriter(const std::filesystem::path &path) : out_(buffer_), path_(path.string())
+{
+#ifdef _WIN32
+  file_ = _wfopen(path.c_str(), L"wb");
+#else
+  file_ = std::fopen(path.c_str(), "wb");
+#endif
+  if (file_ == nullptr) {
+    throw_error();
+  }
+}
+
+ByteWriter::~ByteWriter()
+{
+  if (file_) {
+    std::fclose(file_);
+  }
+}
+
+void ByteWriter::bytes(const void *data, size_t size)
+{
+  /* Empty payloads may have no data pointer, which memcpy() does not accept. */
+  if (size == 0) {
+    return;
+  }
+  size_t offset = out_.size();
+  out_.resize(offset + size);
+  memcpy(out_.data() + offset, data, size);
+  flush_if_full();
+}
+
+void ByteWriter::zeros(size_t size)
+{
+  out_.resize(out_.size() + size, 0);
+  flush_if_full();
+}
+
+void ByteWriter::copy_from(const ByteSource &source, uint64_t offset, uint64_t size)
+{
+  if (offset > source.size() || size > source.size() - offset) {
+    throw UnexpectedEndOfFile();
+  }
+  copy_file_range_from(source, offset, size);
+  while (size > 0) {
+    size_t chunk = size_t(std::min<uint64_t>(size, FLUSH_SIZE));
+    if (source.is_mapped()) {
+      bytes(source.mapped_data() + offset, chunk);
+    }
+    else {
+      size_t end = out_.size();
+      out_.resize(end + chunk);
+      source.read_at(offset, out_.data() + end, chunk);
+      flush_if_full();
+    }
+    offset += chunk;
+    size -= chunk;
+  }
+}
+
+/* Copy what the kernel can, leaving `offset` and `size` at the rest. */
+void ByteWriter::copy_file_range_from(const ByteSource &source, uint64_t &offset, uint64_t &size)
+{
+#ifdef __linux__
+  if (!file_ || source.file_descriptor() < 0 || size == 0) {
+    return;
+  }
+  flush();
+  if (std::fflush(file_) != 0) {
+    throw_error();
+  }
+  loff_t in_offset = loff_t(offset);
+  loff_t out_offset = loff_t(flushed_);
+  while (size > 0) {
+    size_t chunk = size_t(std::min<uint64_t>(size, 1 << 30));
+    ssize_t n = copy_file_range(
+        source.file_descriptor(), &in_offset, fileno(file_), &out_offset, chunk, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* Not supported for these files, e.g. across file systems on older kernels. */
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        break;
+      }
+      throw_error();
+    }
+    if (n == 0) {
+      throw UnexpectedEndOfFile();
+    }
+    offset += uint64_t(n);
+    size -= uint64_t(n);
+    flushed_ += uint64_t(n);
+  }
+  /* The stream position did not move with the copy. */
+  seek(flushed_);
+#endif
+}
+
+void ByteWriter::patch(uint64_t offset, const void *data, size_t size)
+{
+  if (offset >= flushed_) {
+    memcpy(out_.data() + (offset - flushed_), data, size);
+    return;
+  }
+  flush();
+  seek(offset);
+  if (std::fwrite(data, 1, size, file_) != size) {
+    throw_error();
+  }
+  seek(flushed_);
+}
+
+void ByteWriter::patch_length(uint64_t end, uint64_t v, bool long_length)
+{
+  uint8_t bytes[8];
+  size_t size = long_length ? 8 : 4;
+  for (size_t i = 0; i < size; i++) {
+    bytes[size - 1 - i] = uint8_t(v >> (8 * i));
+  }
+  patch(end - size, bytes, size);
+}
+
+void ByteWriter::finish()
+{
+  if (!file_) {
+    return;
+  }
+  flush();
+  std::FILE *file = file_;
+  file_ = nullptr;
+  if (std::fclose(file) != 0) {
+    throw_error();
+  }
+}
+
+void ByteWriter::flush()
+{
+  if (!file_ || out_.empty()) {
+    return;
+  }
+  if (std::fwrite(out_.data(), 1, out_.size(), file_) != out_.size()) {
+    throw_error();
+  }
+  flushed_ += out_.size();
+  out_.clear();
+}
+
+void ByteWriter::seek(uint64_t offset)
+{
+#ifdef _WIN32
+  int result = _fseeki64(file_, int64_t(offset), SEEK_SET);
+#else
+  int result = fseeko(file_, off_t(offset), SEEK_SET);
+#endif
+  if (result != 0) {
+    throw_error();
+  }
+}
+
+void ByteWriter::throw_error() const
+{
+  throw std::system_error(errno, std::generic_category(), path_);
+}
+
+void write_rect(ByteWriter &writer, const Rect &rect)
+{
+  writer.u32(rect.top);
+  writer.u32(rect.left);
+  writer.u32(rect.bottom);
+  writer.u32(rect.right);
+}
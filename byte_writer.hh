@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class ByteSource;
+struct Rect;
+
+/* Writes big-endian values to a growing buffer, or through a buffer to a file. Lengths that are
+ * only known once the data they cover is written can be filled in afterwards, also when those
+ * bytes already went to the file. */
+class ByteWriter {
+ public:
+  /* Append to `out`, which must outlive the writer. */
+  explicit ByteWriter(std::vector<uint8_t> &out);
+  /* Create or truncate the file. Throws std::system_error if it can not be opened, and the other
+   * functions throw it on write errors. */
+  explicit ByteWriter(const std::filesystem::path &path);
+  ~ByteWriter();
+
+  ByteWriter(const ByteWriter &) = delete;
+  ByteWriter &operator=(const ByteWriter &) = delete;
+
+  /* Bytes written so far. */
+  uint64_t size() const
+  {
+    return flushed_ + out_.size();
+  }
+
+  void bytes(const void *data, size_t size);
+  void zeros(size_t size);
+
+  void text(const char *s)
+  {
+    bytes(s, strlen(s));
+  }
+
+  void u8(uint8_t v)
+  {
+    out_.push_back(v);
+    flush_if_full();
+  }
+
+  void u16(uint16_t v)
+  {
+    u8(uint8_t(v >> 8));
+    u8(uint8_t(v));
+  }
+
+  void u32(uint32_t v)
+  {
+    u16(uint16_t(v >> 16));
+    u16(uint16_t(v));
+  }
+
+  void u64(uint64_t v)
+  {
+    u32(uint32_t(v >> 32));
+    u32(uint32_t(v));
+  }
+
+  /* Lengths that are 32-bit in PSD and 64-bit in PSB. */
+  void length(uint64_t v, bool long_length)
+  {
+    if (long_length) {
+      u64(v);
+    }
+    else {
+      u32(uint32_t(v));
+    }
+  }
+
+  /* Append `size` bytes of `source` starting at `offset`. Between two files on Linux the copy is
+   * done by the kernel with copy_file_range(), which shares the blocks instead of copying them on
+   * file systems with reflinks (Btrfs, XFS) when the offsets line up, so large unchanged ranges
+   * cost little. Otherwise the bytes go through the buffer. */
+  void copy_from(const ByteSource &source, uint64_t offset, uint64_t size);
+
+  /* Overwrite bytes written before. */
+  void patch(uint64_t offset, const void *data, size_t size);
+
+  /* Fill in a length field that ends at `end`. */
+  void patch_length(uint64_t end, uint64_t v, bool long_length);
+
+  /* Write a placeholder length to fill in with end_section() once the section is written.
+   * Returns where the section body starts. */
+  uint64_t begin_section(bool long_length)
+  {
+    length(0, long_length);
+    return size();
+  }
+
+  void end_section(uint64_t begin, bool long_length)
+  {
+    patch_length(begin, size() - begin, long_length);
+  }
+
+  /* Write out what is still buffered and close the file. Errors on close are only reported from
+   * here, not from the destructor. */
+  void finish();
+
+ private:
+  static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+  void flush_if_full()
+  {
+    if (file_ && out_.size() >= FLUSH_SIZE) {
+      flush();
+    }
+  }
+
+  void flush();
+  void copy_file_range_from(const ByteSource &source, uint64_t &offset, uint64_t &size);
+  void seek(uint64_t offset);
+  [[noreturn]] void throw_error() const;
+
+  std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> &out_;
+  std::FILE *file_ = nullptr;
+  std::string path_;
+  /* Bytes already written to the file, `out_` holds the ones after them. */
+  uint64_t flushed_ = 0;
+};
+
+/* Top, left, bottom, right, the order read_rect() reads. */
+void write_rect(ByteWriter &writer, const Rect &rect);
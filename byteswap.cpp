@@ -0,0 +1,119 @@
+#include "byteswap.hh"
+
+static void be_to_native_u16_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    uint16_t value = load_be<uint16_t>(src + i * 2);
+    memcpy(dst + i * 2, &value, 2);
+  }
+}
+
+static void be_to_native_u32_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    uint32_t value = load_be<uint32_t>(src + i * 4);
+    memcpy(dst + i * 4, &value, 4);
+  }
+}
+
+#if PSD_SIMD_X86
+
+static void be_to_native_u16_sse2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 2), v);
+  }
+  be_to_native_u16_scalar(dst + i * 2, src + i * 2, count - i);
+}
+
+static void be_to_native_u32_sse2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+    /* Swap the 16-bit halves of each word, then the bytes of each half. */
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), v);
+  }
+  be_to_native_u32_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+PSD_TARGET_AVX2 static void be_to_native_u16_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  const __m256i shuffle = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 2));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 2), _mm256_shuffle_epi8(v, shuffle));
+  }
+  be_to_native_u16_sse2(dst + i * 2, src + i * 2, count - i);
+}
+
+PSD_TARGET_AVX2 static void be_to_native_u32_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  const __m256i shuffle = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_shuffle_epi8(v, shuffle));
+  }
+  be_to_native_u32_sse2(dst + i * 4, src + i * 4, count - i);
+}
+
+#endif
+
+void be_to_native_u16(void *dst, const uint8_t *src, size_t count, SIMDLevel level)
+{
+  uint8_t *out = static_cast<uint8_t *>(dst);
+  if constexpr (std::endian::native == std::endian::big) {
+    memmove(out, src, count * 2);
+    return;
+  }
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    be_to_native_u16_avx2(out, src, count);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    be_to_native_u16_sse2(out, src, count);
+    return;
+  }
+#endif
+  be_to_native_u16_scalar(out, src, count);
+}
+
+void be_to_native_u32(void *dst, const uint8_t *src, size_t count, SIMDLevel level)
+{
+  uint8_t *out = static_cast<uint8_t *>(dst);
+  if constexpr (std::endian::native == std::endian::big) {
+    memmove(out, src, count * 4);
+    return;
+  }
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    be_to_native_u32_avx2(out, src, count);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    be_to_native_u32_sse2(out, src, count);
+    return;
+  }
+#endif
+  be_to_native_u32_scalar(out, src, count);
+}
+
+void be_to_native_u16(void *dst, const uint8_t *src, size_t count)
+{
+  be_to_native_u16(dst, src, count, simd_level());
+}
+
+void be_to_native_u32(void *dst, const uint8_t *src, size_t count)
+{
+  be_to_native_u32(dst, src, count, simd_level());
+}
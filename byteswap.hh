@@ -0,0 +1,31 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "simd.hh"
+
+/* Load a big-endian integer from unaligned memory. */
+template<typename T> inline T load_be(const uint8_t *src)
+{
+  static_assert(std::is_integral_v<T>);
+  T value;
+  memcpy(&value, src, sizeof(T));
+  if constexpr (std::endian::native == std::endian::little && sizeof(T) > 1) {
+    value = std::byteswap(value);
+  }
+  return value;
+}
+
+/* Convert `count` big-endian 16/32-bit values from `src` to native order in `dst`. Neither
+ * pointer needs to be aligned, and `dst` may be any trivially copyable array of the right size
+ * (e.g. an array of BlendingRange). `dst` and `src` may be the same buffer. */
+void be_to_native_u16(void *dst, const uint8_t *src, size_t count);
+void be_to_native_u32(void *dst, const uint8_t *src, size_t count);
+
+/* Same, with an explicit kernel instead of the one selected by simd_level(). */
+void be_to_native_u16(void *dst, const uint8_t *src, size_t count, SIMDLevel level);
+void be_to_native_u32(void *dst, const uint8_t *src, size_t count, SIMDLevel level);
@@ -0,0 +1,420 @@
+#include "composite.hh"
+#include "blend.hh"
+#include "interleave.hh"
+#include "thread_pool.hh"
+#include "trace.hh"
+
+#include <algorithm>
+#include <cstring>
+
+/* Scanlines of one layer blended per task. */
+static constexpr size_t COMPOSITE_ROWS_PER_TASK = 64;
+
+namespace {
+
+/* Canvas area, layer coordinates are signed even though Rect stores them unsigned. */
+struct Bounds {
+  int64_t x0, y0, x1, y1;
+
+  bool empty() const
+  {
+    return x0 >= x1 || y0 >= y1;
+  }
+
+  bool contains(int64_t x, int64_t y) const
+  {
+    return x >= x0 && x < x1 && y >= y0 && y < y1;
+  }
+
+  int64_t width() const
+  {
+    return x1 - x0;
+  }
+
+  size_t num_pixels() const
+  {
+    return empty() ? 0 : size_t(x1 - x0) * size_t(y1 - y0);
+  }
+};
+
+/* A layer channel and the area it covers. `outside` is the value for pixels outside it. */
+struct Plane {
+  const uint8_t *data = nullptr;
+  Bounds bounds = {0, 0, 0, 0};
+  uint8_t outside = 0;
+
+  uint8_t at(int64_t x, int64_t y) const
+  {
+    if (!bounds.contains(x, y)) {
+      return outside;
+    }
+    return data ? data[(y - bounds.y0) * bounds.width() + (x - bounds.x0)] : 255;
+  }
+};
+
+/* Everything needed to blend one layer, resolved before any pixel is touched. */
+struct LayerPlan {
+  /* Index in LayerInfo::layer_records. */
+  size_t layer;
+  BlendSpanFunction blend;
+  uint8_t opacity;
+  /* Layer rectangle, and the part of it inside the canvas. */
+  Bounds rect;
+  Bounds visible;
+  const uint8_t *color[3];
+  /* nullptr for layers without a transparency channel. */
+  const uint8_t *alpha;
+  bool has_mask;
+  Plane mask;
+  bool clipped;
+  /* Alpha of the layer this one is clipped to. */
+  Plane clip_base;
+};
+
+/* Four planes (R, G, B, A) stored one after the other, covering `bounds` of the canvas with rows
+ * `bounds.width()` apart. */
+struct CanvasView {
+  uint8_t *planes[4];
+  Bounds bounds;
+
+  CanvasView(uint8_t *data, const Bounds &view_bounds) : bounds(view_bounds)
+  {
+    for (size_t c = 0; c < 4; c++) {
+      planes[c] = data + c * bounds.num_pixels();
+    }
+  }
+
+  size_t offset(int64_t x, int64_t y) const
+  {
+    return size_t((y - bounds.y0) * bounds.width() + (x - bounds.x0));
+  }
+};
+
+}  // namespace
+
+static Bounds to_bounds(const Rect &rect)
+{
+  return {int32_t(rect.left), int32_t(rect.top), int32_t(rect.right), int32_t(rect.bottom)};
+}
+
+static Rect to_rect(const Bounds &bounds)
+{
+  return {uint32_t(bounds.y0), uint32_t(bounds.x0), uint32_t(bounds.y1), uint32_t(bounds.x1)};
+}
+
+static Bounds intersect(const Bounds &a, const Bounds &b)
+{
+  return {std::max(a.x0, b.x0), std::max(a.y0, b.y0), std::min(a.x1, b.x1), std::min(a.y1, b.y1)};
+}
+
+static Bounds unite(const Bounds &a, const Bounds &b)
+{
+  if (a.empty()) {
+    return b;
+  }
+  if (b.empty()) {
+    return a;
+  }
+  return {std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1)};
+}
+
+static void check_supported(const FileHeader &header)
+{
+  if (header.depth != 8 ||
+      (header.color_mode != ColorMode::RGB && header.color_mode != ColorMode::Grayscale))
+  {
+    throw UnsupportedFormat();
+  }
+}
+
+/* Samples of a layer channel, nullptr if the layer has no channel with this ID or its data does
+ * not match the channel area. */
+static const uint8_t *find_channel(const LayerInfo &layers, size_t layer, uint16_t channel_id)
+{
+  const LayerRecord &record = layers.layer_records[layer];
+  uint32_t first = layers.table.first_channel[layer];
+  for (size_t k = 0; k < record.channel_info.size(); k++) {
+    if (record.channel_info[k].id != channel_id) {
+      continue;
+    }
+    const ChannelImageData &channel = layers.channel_image_data[first + k];
+    if (channel.data.size() != channel_rect(record, channel_id).calc_size()) {
+      return nullptr;
+    }
+    return reinterpret_cast<const uint8_t *>(channel.data.data());
+  }
+  return nullptr;
+}
+
+/* `table` holds the current layer attributes, which may differ from `layers.table`. */
+static std::vector<LayerPlan> plan_layers(const LayerInfo &layers,
+                                          const LayerTable &table,
+                                          const FileHeader &header)
+{
+  std::vector<LayerPlan> plans;
+  if (table.size() == 0) {
+    return plans;
+  }
+  if (layers.channel_image_data.size() != table.first_channel.back()) {
+    throw UnsupportedFormat();
+  }
+  size_t num_color_channels = header.color_mode == ColorMode::RGB ? 3 : 1;
+  Bounds canvas = {0, 0, int64_t(header.width), int64_t(header.height)};
+
+  /* The layer that following clipped layers are clipped to. */
+  Plane clip_base;
+  bool clip_base_visible = false;
+  for (size_t i = 0; i < table.size(); i++) {
+    Bounds rect = to_bounds(table.rects[i]);
+    if (!table.clipping[i]) {
+      clip_base = {find_channel(layers, i, CHANNEL_ID_TRANSPARENCY), rect, 0};
+      clip_base_visible = table.is_visible(i);
+    }
+    else if (!clip_base_visible) {
+      continue;
+    }
+    if (!table.is_visible(i) || table.opacities[i] == 0) {
+      continue;
+    }
+
+    LayerPlan plan;
+    plan.layer = i;
+    plan.rect = rect;
+    plan.visible = intersect(rect, canvas);
+    if (table.clipping[i]) {
+      /* Outside of the base the clipped layer is fully transparent, don't blend it there. This
+       * also keeps everything a layer affects within the rectangles of the layer itself. */
+      plan.visible = intersect(plan.visible, clip_base.bounds);
+    }
+    if (plan.visible.empty()) {
+      continue;
+    }
+    bool has_color = true;
+    for (size_t c = 0; c < 3; c++) {
+      plan.color[c] = find_channel(layers, i, uint16_t(num_color_channels == 3 ? c : 0));
+      has_color &= plan.color[c] != nullptr;
+    }
+    if (!has_color) {
+      PSD_TRACE_WARN("composite", "layer %zu is missing color channels, skipping it", i);
+      continue;
+    }
+    plan.alpha = find_channel(layers, i, CHANNEL_ID_TRANSPARENCY);
+
+    const LayerMaskData &mask_data = layers.layer_records[i].layer_mask_data;
+    const uint8_t *mask = find_channel(layers, i, CHANNEL_ID_USER_MASK);
+    plan.has_mask = mask && mask_data.length != 0 && !mask_data.layer_mask_disabled;
+    if (plan.has_mask) {
+      plan.mask = {mask, to_bounds(mask_data.rect), mask_data.default_color};
+    }
+    plan.clipped = table.clipping[i];
+    plan.clip_base = clip_base;
+
+    BlendMode mode;
+    if (!blend_mode_from_key(table.blend_modes[i], &mode)) {
+      PSD_TRACE_WARN("composite",
+                     "layer %zu has unsupported blend mode '%.4s', using normal",
+                     i,
+                     layers.layer_records[i].blend_mode_key);
+      mode = BlendMode::Normal;
+    }
+    plan.blend = blend_span_function(mode);
+    plan.opacity = table.opacities[i];
+    plans.push_back(plan);
+  }
+  return plans;
+}
+
+static uint8_t mul_u8(uint8_t a, uint8_t b)
+{
+  return uint8_t((unsigned(a) * b + 127) / 255);
+}
+
+/* Blend the part of canvas row `y` between `x0` and `x1` with one layer. */
+static void blend_layer_row(const LayerPlan &plan,
+                            const CanvasView &canvas,
+                            int64_t y,
+                            int64_t x0,
+                            int64_t x1)
+{
+  size_t count = size_t(x1 - x0);
+  size_t offset = size_t((y - plan.rect.y0) * plan.rect.width() + (x0 - plan.rect.x0));
+  const uint8_t *alpha = plan.alpha ? plan.alpha + offset : nullptr;
+  if (!alpha || plan.has_mask || plan.clipped) {
+    /* Scratch space reused across rows, so blending does not allocate per row. */
+    thread_local std::vector<uint8_t> alpha_row;
+    alpha_row.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      int64_t x = x0 + int64_t(i);
+      uint8_t a = alpha ? alpha[i] : 255;
+      if (plan.has_mask) {
+        a = mul_u8(a, plan.mask.at(x, y));
+      }
+      if (plan.clipped) {
+        a = mul_u8(a, plan.clip_base.at(x, y));
+      }
+      alpha_row[i] = a;
+    }
+    alpha = alpha_row.data();
+  }
+
+  const uint8_t *src[4] = {
+      plan.color[0] + offset, plan.color[1] + offset, plan.color[2] + offset, alpha};
+  size_t canvas_offset = canvas.offset(x0, y);
+  uint8_t *dst[4] = {canvas.planes[0] + canvas_offset,
+                     canvas.planes[1] + canvas_offset,
+                     canvas.planes[2] + canvas_offset,
+                     canvas.planes[3] + canvas_offset};
+  plan.blend(dst, src, plan.opacity, count);
+}
+
+/* Blend the planned layers with indices in [first_layer, end_layer), bottom to top, into the
+ * `region` of the canvas, which must lie inside the view. */
+static void composite_region(const std::vector<LayerPlan> &plans,
+                             size_t first_layer,
+                             size_t end_layer,
+                             const CanvasView &canvas,
+                             const Bounds &region,
+                             ThreadPool *thread_pool)
+{
+  for (const LayerPlan &plan : plans) {
+    if (plan.layer < first_layer || plan.layer >= end_layer) {
+      continue;
+    }
+    Bounds area = intersect(plan.visible, region);
+    if (area.empty()) {
+      continue;
+    }
+    size_t num_rows = size_t(area.y1 - area.y0);
+    auto blend_rows = [&](size_t task) {
+      size_t begin = task * COMPOSITE_ROWS_PER_TASK;
+      size_t end = std::min(begin + COMPOSITE_ROWS_PER_TASK, num_rows);
+      for (size_t row = begin; row < end; row++) {
+        blend_layer_row(plan, canvas, area.y0 + int64_t(row), area.x0, area.x1);
+      }
+    };
+    size_t num_tasks = (num_rows + COMPOSITE_ROWS_PER_TASK - 1) / COMPOSITE_ROWS_PER_TASK;
+    if (thread_pool) {
+      thread_pool->parallel_for(num_tasks, blend_rows);
+    }
+    else {
+      for (size_t task = 0; task < num_tasks; task++) {
+        blend_rows(task);
+      }
+    }
+  }
+}
+
+/* Copy `region` between two views that both contain it. */
+static void copy_region(const CanvasView &src, const CanvasView &dst, const Bounds &region)
+{
+  for (size_t c = 0; c < 4; c++) {
+    for (int64_t y = region.y0; y < region.y1; y++) {
+      memcpy(dst.planes[c] + dst.offset(region.x0, y),
+             src.planes[c] + src.offset(region.x0, y),
+             size_t(region.width()));
+    }
+  }
+}
+
+static std::vector<uint8_t> interleave_region(const CanvasView &canvas, const Bounds &region)
+{
+  size_t count = size_t(region.width());
+  std::vector<uint8_t> pixels(region.num_pixels() * 4);
+  for (int64_t y = region.y0; y < region.y1; y++) {
+    size_t offset = canvas.offset(region.x0, y);
+    interleave_rgba8(pixels.data() + size_t(y - region.y0) * count * 4,
+                     canvas.planes[0] + offset,
+                     canvas.planes[1] + offset,
+                     canvas.planes[2] + offset,
+                     canvas.planes[3] + offset,
+                     count);
+  }
+  return pixels;
+}
+
+std::vector<uint8_t> composite_layers_rgba8(const LayerInfo &layers,
+                                            const FileHeader &header,
+                                            ThreadPool *thread_pool)
+{
+  check_supported(header);
+  std::vector<LayerPlan> plans = plan_layers(layers, layers.table, header);
+  Bounds canvas_bounds = {0, 0, int64_t(header.width), int64_t(header.height)};
+  std::vector<uint8_t> planes(canvas_bounds.num_pixels() * 4);
+  CanvasView canvas(planes.data(), canvas_bounds);
+  composite_region(plans, 0, SIZE_MAX, canvas, canvas_bounds, thread_pool);
+  return interleave_region(canvas, canvas_bounds);
+}
+
+Compositor::Compositor(const LayerInfo &layers, const FileHeader &header, ThreadPool *thread_pool)
+    : layers_(&layers), header_(header), thread_pool_(thread_pool), table_(layers.table)
+{
+  check_supported(header);
+  std::vector<LayerPlan> plans = plan_layers(layers, table_, header);
+  Bounds canvas_bounds = {0, 0, int64_t(header.width), int64_t(header.height)};
+  planes_.resize(canvas_bounds.num_pixels() * 4);
+  CanvasView canvas(planes_.data(), canvas_bounds);
+  composite_region(plans, 0, SIZE_MAX, canvas, canvas_bounds, thread_pool);
+}
+
+Rect Compositor::set_visible(size_t layer, bool visible)
+{
+  uint8_t flags = visible ? uint8_t(table_.flags[layer] & ~LAYER_FLAG_HIDDEN) :
+                            uint8_t(table_.flags[layer] | LAYER_FLAG_HIDDEN);
+  if (flags == table_.flags[layer]) {
+    return {0, 0, 0, 0};
+  }
+  table_.flags[layer] = flags;
+  return recomposite(layer);
+}
+
+Rect Compositor::set_opacity(size_t layer, uint8_t opacity)
+{
+  if (opacity == table_.opacities[layer]) {
+    return {0, 0, 0, 0};
+  }
+  table_.opacities[layer] = opacity;
+  return recomposite(layer);
+}
+
+Rect Compositor::recomposite(size_t layer)
+{
+  /* Only the layer's own pixels change, its mask and any layers clipped to it stay inside the
+   * union of its rectangle and its mask rectangle. */
+  const LayerRecord &record = layers_->layer_records[layer];
+  Bounds dirty = to_bounds(record.rect);
+  if (record.layer_mask_data.length != 0) {
+    dirty = unite(dirty, to_bounds(record.layer_mask_data.rect));
+  }
+  Bounds canvas_bounds = {0, 0, int64_t(header_.width), int64_t(header_.height)};
+  dirty = intersect(dirty, canvas_bounds);
+  if (dirty.empty()) {
+    return {0, 0, 0, 0};
+  }
+
+  std::vector<LayerPlan> plans = plan_layers(*layers_, table_, header_);
+  /* The dirty area only depends on the layer, so the backdrop of everything below it can be
+   * reused while the same layer keeps changing. */
+  if (backdrop_layer_ != layer) {
+    backdrop_.assign(dirty.num_pixels() * 4, 0);
+    composite_region(plans, 0, layer, CanvasView(backdrop_.data(), dirty), dirty, thread_pool_);
+    backdrop_layer_ = layer;
+  }
+  CanvasView backdrop(backdrop_.data(), dirty);
+  CanvasView canvas(planes_.data(), canvas_bounds);
+  copy_region(backdrop, canvas, dirty);
+  composite_region(plans, layer, SIZE_MAX, canvas, dirty, thread_pool_);
+  return to_rect(dirty);
+}
+
+std::vector<uint8_t> Compositor::rgba8() const
+{
+  return rgba8({0, 0, header_.height, header_.width});
+}
+
+std::vector<uint8_t> Compositor::rgba8(const Rect &region) const
+{
+  Bounds canvas_bounds = {0, 0, int64_t(header_.width), int64_t(header_.height)};
+  /* CanvasView is only read from here. */
+  CanvasView canvas(const_cast<uint8_t *>(planes_.data()), canvas_bounds);
+  return interleave_region(canvas, intersect(to_bounds(region), canvas_bounds));
+}
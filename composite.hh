@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "psd.hh"
+
+/* Flatten the visible layers into RGBA pixels with straight alpha, starting from a transparent
+ * canvas. Each layer is blended with its blend mode, opacity, transparency channel, user mask and
+ * clipping; modes without a kernel (see blend_mode_from_key()) are blended as normal. Groups are
+ * not isolated, their layers are blended as if they were top-level. Needs an 8-bit RGB or
+ * grayscale document, anything else throws UnsupportedFormat. When `thread_pool` is set,
+ * scanlines of a layer are blended concurrently. */
+std::vector<uint8_t> composite_layers_rgba8(const LayerInfo &layers,
+                                            const FileHeader &header,
+                                            ThreadPool *thread_pool = nullptr);
+
+/* Keeps the composite of composite_layers_rgba8() around so that a change to one layer only
+ * recomposites the part of the canvas the layer covers: the union of its rectangle and its mask
+ * rectangle. The backdrop below the last changed layer is cached for that area, so repeatedly
+ * changing the same layer only blends the layers from it upwards. `layers` must outlive the
+ * compositor. */
+class Compositor {
+ public:
+  Compositor(const LayerInfo &layers, const FileHeader &header, ThreadPool *thread_pool = nullptr);
+
+  /* Both return the canvas area that was recomposited, empty when nothing changed. */
+  Rect set_visible(size_t layer, bool visible);
+  Rect set_opacity(size_t layer, uint8_t opacity);
+
+  /* The layer attributes as currently edited. */
+  const LayerTable &table() const
+  {
+    return table_;
+  }
+
+  std::vector<uint8_t> rgba8() const;
+  /* Only the part of the canvas inside `region`, e.g. the area returned by set_opacity(). */
+  std::vector<uint8_t> rgba8(const Rect &region) const;
+
+ private:
+  Rect recomposite(size_t layer);
+
+  const LayerInfo *layers_;
+  FileHeader header_;
+  ThreadPool *thread_pool_;
+  LayerTable table_;
+  /* R, G, B and A planes of the whole canvas. */
+  std::vector<uint8_t> planes_;
+  size_t backdrop_layer_ = SIZE_MAX;
+  std::vector<uint8_t> backdrop_;
+};
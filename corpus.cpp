@@ -0,0 +1,431 @@
+#include "corpus.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <string>
+
+#include "byte_writer.hh"
+#include "packbits.hh"
+#include "predictor.hh"
+#include "zip.hh"
+
+namespace {
+
+/* xorshift64*, so the corpus is the same with every standard library. */
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed * 0x9E3779B97F4A7C15ull + 1)
+  {
+  }
+
+  uint64_t next()
+  {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545F4914F6CDD1Dull;
+  }
+
+  /* Uniform enough in [0, n) for test data. */
+  uint32_t below(uint32_t n)
+  {
+    return uint32_t((next() >> 32) % n);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+/* Generates the big-endian scanlines of one plane. Rows are made of segments that are flat,
+ * gradients or noise, and the layout of the segments is kept for a band of rows, the way artwork
+ * has regions. */
+class PlaneGenerator {
+ public:
+  PlaneGenerator(uint32_t width, uint16_t depth, float entropy, Random &random)
+      : width_(width),
+        depth_(depth),
+        noise_threshold_(uint32_t(std::clamp(entropy, 0.0f, 1.0f) * 1024.0f)),
+        random_(random),
+        row_(width)
+  {
+  }
+
+  void next_row(uint8_t *dst)
+  {
+    if (band_rows_left_ == 0) {
+      band_rows_left_ = 4 + random_.below(60);
+      segments_.clear();
+      for (uint32_t x = 0; x < width_;) {
+        Segment segment;
+        segment.length = std::min(8 + random_.below(400), width_ - x);
+        if (random_.below(1024) < noise_threshold_) {
+          segment.kind = SegmentKind::Noise;
+        }
+        else {
+          /* Two thirds of the rest are flat. */
+          segment.kind = random_.below(3) == 2 ? SegmentKind::Gradient : SegmentKind::Flat;
+        }
+        segment.a = random_.below(256);
+        segment.b = random_.below(256);
+        segments_.push_back(segment);
+        x += segment.length;
+      }
+    }
+    band_rows_left_--;
+
+    uint32_t x = 0;
+    for (const Segment &segment : segments_) {
+      int32_t a = int32_t(segment.a);
+      int32_t b = int32_t(segment.b);
+      for (uint32_t i = 0; i < segment.length; i++, x++) {
+        int32_t v;
+        switch (segment.kind) {
+          case SegmentKind::Flat:
+            v = a;
+            break;
+          case SegmentKind::Gradient:
+            v = a + (b - a) * int32_t(i) / int32_t(segment.length) + int32_t(y_ & 7);
+            break;
+          default:
+            v = a / 2 + int32_t(random_.below(128));
+            break;
+        }
+        row_[x] = uint32_t(v) & 0xFF;
+      }
+    }
+    y_++;
+
+    for (uint32_t i = 0; i < width_; i++) {
+      if (depth_ == 8) {
+        dst[i] = uint8_t(row_[i]);
+      }
+      else if (depth_ == 16) {
+        uint16_t v = uint16_t(row_[i] * 257);
+        dst[i * 2] = uint8_t(v >> 8);
+        dst[i * 2 + 1] = uint8_t(v);
+      }
+      else {
+        uint32_t v = std::bit_cast<uint32_t>(float(row_[i]) / 255.0f);
+        for (size_t k = 0; k < 4; k++) {
+          dst[i * 4 + k] = uint8_t(v >> (24 - 8 * k));
+        }
+      }
+    }
+  }
+
+ private:
+  enum class SegmentKind {
+    Flat,
+    Gradient,
+    Noise,
+  };
+
+  struct Segment {
+    uint32_t length;
+    SegmentKind kind;
+    uint32_t a;
+    uint32_t b;
+  };
+
+  uint32_t width_;
+  uint16_t depth_;
+  /* Out of 1024 segments. */
+  uint32_t noise_threshold_;
+  Random &random_;
+  std::vector<Segment> segments_;
+  uint32_t band_rows_left_ = 0;
+  uint32_t y_ = 0;
+  std::vector<uint32_t> row_;
+};
+
+/* Compressed image data of `num_planes` planes, without the compression field, generated and
+ * encoded a scanline at a time. Several planes are stored the way the merged image stores them:
+ * all RLE byte counts first, and one ZIP stream. */
+static void write_planes(ByteWriter &writer,
+                         const CorpusDocumentSpec &spec,
+                         uint32_t num_planes,
+                         uint32_t width,
+                         uint32_t height,
+                         Random &random)
+{
+  size_t row_size = calc_row_size(width, spec.depth);
+  std::vector<uint8_t> row(row_size);
+  switch (spec.compression) {
+    case Compression::Raw:
+      for (uint32_t c = 0; c < num_planes; c++) {
+        PlaneGenerator plane(width, spec.depth, spec.entropy, random);
+        for (uint32_t y = 0; y < height; y++) {
+          plane.next_row(row.data());
+          writer.bytes(row.data(), row.size());
+        }
+      }
+      break;
+    case Compression::RLE: {
+      /* The byte counts are only known once the rows are encoded. */
+      size_t count_size = spec.psb ? 4 : 2;
+      std::vector<uint8_t> counts(size_t(num_planes) * height * count_size);
+      uint64_t counts_offset = writer.size();
+      writer.zeros(counts.size());
+      std::vector<uint8_t> encoded(packbits_max_encoded_size(row_size));
+      uint8_t *count = counts.data();
+      for (uint32_t c = 0; c < num_planes; c++) {
+        PlaneGenerator plane(width, spec.depth, spec.entropy, random);
+        for (uint32_t y = 0; y < height; y++) {
+          plane.next_row(row.data());
+          size_t n = packbits_encode(encoded.data(), row.data(), row.size());
+          writer.bytes(encoded.data(), n);
+          for (size_t i = 0; i < count_size; i++) {
+            *count++ = uint8_t(n >> (8 * (count_size - 1 - i)));
+          }
+        }
+      }
+      writer.patch(counts_offset, counts.data(), counts.size());
+      break;
+    }
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      ZipCompressor compressor;
+      std::vector<uint8_t> stream;
+      for (uint32_t c = 0; c < num_planes; c++) {
+        PlaneGenerator plane(width, spec.depth, spec.entropy, random);
+        for (uint32_t y = 0; y < height; y++) {
+          plane.next_row(row.data());
+          if (spec.compression == Compression::ZIPPrediction) {
+            predict_row(row.data(), width, spec.depth);
+          }
+          if (!compressor.compress(stream, row.data(), row.size(), false)) {
+            throw InvalidCompressedData();
+          }
+          if (stream.size() >= (1 << 20)) {
+            writer.bytes(stream.data(), stream.size());
+            stream.clear();
+          }
+        }
+      }
+      if (!compressor.compress(stream, nullptr, 0, true)) {
+        throw InvalidCompressedData();
+      }
+      writer.bytes(stream.data(), stream.size());
+      break;
+    }
+  }
+}
+
+struct Layer {
+  Rect rect;
+  /* Empty without a mask. */
+  Rect mask_rect;
+  uint16_t num_channels;
+  /* Where the data length field of each channel in the layer record ends, to fill in once the
+   * channel data is written. */
+  uint64_t channel_length_ends[5];
+};
+
+static const uint16_t CHANNEL_IDS[5] = {
+    0, 1, 2, CHANNEL_ID_TRANSPARENCY, CHANNEL_ID_USER_MASK};
+
+static uint32_t rect_width(const Rect &rect)
+{
+  return uint32_t(int32_t(rect.right) - int32_t(rect.left));
+}
+
+static uint32_t rect_height(const Rect &rect)
+{
+  return uint32_t(int32_t(rect.bottom) - int32_t(rect.top));
+}
+
+static void write_layer_record(ByteWriter &writer,
+                               Layer &layer,
+                               const CorpusDocumentSpec &spec,
+                               uint32_t index)
+{
+  write_rect(writer, layer.rect);
+  writer.u16(layer.num_channels);
+  for (size_t c = 0; c < layer.num_channels; c++) {
+    writer.u16(CHANNEL_IDS[c]);
+    layer.channel_length_ends[c] = writer.begin_section(spec.psb);
+  }
+  writer.text("8BIMnorm");
+  writer.u8(255);
+  writer.u8(0);
+  writer.u8(0);
+  writer.u8(0);
+
+  uint64_t extra = writer.begin_section(false);
+  if (layer.num_channels == 5) {
+    writer.u32(20);
+    write_rect(writer, layer.mask_rect);
+    /* Default color, flags and padding. */
+    writer.u8(255);
+    writer.u8(0);
+    writer.u16(0);
+  }
+  else {
+    writer.u32(0);
+  }
+  /* Blending ranges: composite gray, then one per channel, all passing everything. */
+  writer.u32(8 * (1 + layer.num_channels));
+  for (size_t i = 0; i < 1 + size_t(layer.num_channels); i++) {
+    writer.u32(0x0000FFFF);
+    writer.u32(0x0000FFFF);
+  }
+  std::string name = "Layer " + std::to_string(index + 1);
+  writer.u8(uint8_t(name.size()));
+  writer.bytes(name.data(), name.size());
+  writer.zeros(3 - name.size() % 4);
+  /* The same name as UTF-16. */
+  writer.text("8BIMluni");
+  writer.u32(uint32_t(4 + 2 * name.size()));
+  writer.u32(uint32_t(name.size()));
+  for (char c : name) {
+    writer.u16(uint16_t(c));
+  }
+  writer.text("8BIMlyid");
+  writer.u32(4);
+  writer.u32(index + 1);
+  writer.end_section(extra, false);
+}
+
+static void write_image_resources(ByteWriter &writer, const CorpusDocumentSpec &spec)
+{
+  uint64_t section = writer.begin_section(false);
+  auto begin_resource = [&](uint16_t id) {
+    writer.text("8BIM");
+    writer.u16(id);
+    /* Empty name, padded to an even size. */
+    writer.u16(0);
+    return writer.begin_section(false);
+  };
+  auto end_resource = [&](uint64_t begin) {
+    writer.end_section(begin, false);
+    if ((writer.size() - begin) % 2 != 0) {
+      writer.u8(0);
+    }
+  };
+
+  /* Resolution info: 72 dpi. */
+  uint64_t resource = begin_resource(1005);
+  for (size_t i = 0; i < 2; i++) {
+    writer.u32(72 << 16);
+    writer.u16(1);
+    writer.u16(1);
+  }
+  end_resource(resource);
+
+  /* A thumbnail with a stand-in for the JFIF data. */
+  resource = begin_resource(IMAGE_RESOURCE_THUMBNAIL);
+  uint32_t jfif_size = 4096;
+  writer.u32(1);
+  writer.u32(160);
+  writer.u32(120);
+  writer.u32(160 * 3);
+  writer.u32(160 * 120 * 3);
+  writer.u32(jfif_size);
+  writer.u16(24);
+  writer.u16(1);
+  Random random(spec.seed);
+  for (uint32_t i = 0; i < jfif_size; i++) {
+    writer.u8(uint8_t(random.next()));
+  }
+  end_resource(resource);
+
+  resource = begin_resource(IMAGE_RESOURCE_XMP);
+  writer.text("<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF/>");
+  writer.zeros(1024);
+  writer.text("</x:xmpmeta>");
+  end_resource(resource);
+
+  writer.end_section(section, false);
+}
+
+static void write_document(ByteWriter &writer, const CorpusDocumentSpec &spec)
+{
+  Random random(spec.seed);
+
+  writer.text("8BPS");
+  writer.u16(spec.psb ? FILE_VERSION_PSB : FILE_VERSION_PSD);
+  writer.zeros(6);
+  writer.u16(3);
+  writer.u32(spec.height);
+  writer.u32(spec.width);
+  writer.u16(spec.depth);
+  writer.u16(uint16_t(ColorMode::RGB));
+  /* No color mode data. */
+  writer.u32(0);
+  write_image_resources(writer, spec);
+
+  std::vector<Layer> layers(spec.num_layers);
+  for (Layer &layer : layers) {
+    /* Layers as large as the canvas or larger start at its corner. */
+    uint32_t top = spec.layer_height < spec.height ?
+                       random.below(spec.height - spec.layer_height + 1) :
+                       0;
+    uint32_t left = spec.layer_width < spec.width ?
+                        random.below(spec.width - spec.layer_width + 1) :
+                        0;
+    layer.rect = {top, left, top + spec.layer_height, left + spec.layer_width};
+    layer.num_channels = spec.layer_masks ? 5 : 4;
+    layer.mask_rect = {top + spec.layer_height / 4,
+                       left + spec.layer_width / 4,
+                       top + spec.layer_height / 4 + spec.layer_height / 2,
+                       left + spec.layer_width / 4 + spec.layer_width / 2};
+  }
+
+  uint64_t layer_and_mask_info = writer.begin_section(spec.psb);
+  uint64_t layer_info = writer.begin_section(spec.psb);
+  writer.u16(uint16_t(spec.num_layers));
+  for (uint32_t i = 0; i < spec.num_layers; i++) {
+    write_layer_record(writer, layers[i], spec, i);
+  }
+  for (const Layer &layer : layers) {
+    for (size_t c = 0; c < layer.num_channels; c++) {
+      const Rect &rect = CHANNEL_IDS[c] == CHANNEL_ID_USER_MASK ? layer.mask_rect : layer.rect;
+      uint64_t begin = writer.size();
+      writer.u16(uint16_t(spec.compression));
+      write_planes(writer, spec, 1, rect_width(rect), rect_height(rect), random);
+      writer.patch_length(layer.channel_length_ends[c], writer.size() - begin, spec.psb);
+    }
+  }
+  if ((writer.size() - layer_info) % 2 != 0) {
+    writer.u8(0);
+  }
+  writer.end_section(layer_info, spec.psb);
+  /* No global layer mask info. */
+  writer.u32(0);
+  writer.end_section(layer_and_mask_info, spec.psb);
+
+  writer.u16(uint16_t(spec.compression));
+  write_planes(writer, spec, 3, spec.width, spec.height, random);
+  writer.finish();
+}
+
+}  // namespace
+
+std::vector<uint8_t> make_corpus_document(const CorpusDocumentSpec &spec)
+{
+  std::vector<uint8_t> out;
+  ByteWriter writer(out);
+  write_document(writer, spec);
+  return out;
+}
+
+void write_corpus_document(const CorpusDocumentSpec &spec, const std::filesystem::path &path)
+{
+  ByteWriter writer(path);
+  write_document(writer, spec);
+}
+
+std::vector<CorpusDocumentSpec> default_corpus()
+{
+  return {
+      {"raw_8", 2048, 2048, 8, 8, 1024, 1024, Compression::Raw, false, 1},
+      {"rle_8", 2048, 2048, 8, 8, 1024, 1024, Compression::RLE, false, 2},
+      {"zip_8", 2048, 2048, 8, 8, 1024, 1024, Compression::ZIP, false, 3},
+      {"rle_16", 1024, 1024, 16, 8, 768, 768, Compression::RLE, false, 4},
+      {"zip_prediction_16", 1024, 1024, 16, 8, 768, 768, Compression::ZIPPrediction, false, 5},
+      {"zip_prediction_32", 1024, 1024, 32, 4, 512, 512, Compression::ZIPPrediction, false, 6},
+      {"psb_rle_8", 4096, 4096, 8, 4, 2048, 2048, Compression::RLE, true, 7},
+      {"many_layers", 1024, 1024, 8, 1000, 64, 64, Compression::RLE, false, 8},
+  };
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "psd.hh"
+
+/* Synthetic documents for benchmarks and stress tests, generated from a seed so every run
+ * measures the same bytes. Pixels mix flat areas, gradients and noise, so RLE and ZIP see data
+ * that compresses about as well as artwork does. */
+
+struct CorpusDocumentSpec {
+  const char *name;
+  uint32_t width;
+  uint32_t height;
+  /* 8, 16 or 32 (float). */
+  uint16_t depth;
+  /* RGB layers with a transparency channel, placed at random inside the canvas. */
+  uint32_t num_layers;
+  uint32_t layer_width;
+  uint32_t layer_height;
+  /* Used for the layer channels and the merged image. */
+  Compression compression;
+  bool psb;
+  uint32_t seed;
+  /* Share of noise in the pixels, from 0 (flat areas and gradients only) to 1 (noise only). */
+  float entropy = 0.25f;
+  /* Give every layer a user mask channel covering the middle of the layer. */
+  bool layer_masks = false;
+};
+
+/* A complete document: header, a few image resources (resolution, thumbnail, XMP), the layer
+ * records with blending ranges and additional layer info, the layer channels and the merged
+ * image. Throws InvalidCompressedData if zlib fails. */
+std::vector<uint8_t> make_corpus_document(const CorpusDocumentSpec &spec);
+
+/* Same bytes, streamed to a file: pixels are generated a scanline at a time and the lengths are
+ * filled in afterwards, so documents much larger than memory can be written. Throws
+ * std::system_error if the file cannot be written and InvalidCompressedData if zlib fails. */
+void write_corpus_document(const CorpusDocumentSpec &spec, const std::filesystem::path &path);
+
+/* The documents the bench executable runs over, one per compression and depth plus a PSB and
+ * one with many small layers. */
+std::vector<CorpusDocumentSpec> default_corpus();
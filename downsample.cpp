@@ -0,0 +1,83 @@
+#include "downsample.hh"
+
+#include <algorithm>
+#include <bit>
+#include <type_traits>
+
+/* Average of `count` samples summing to `sum`, integers are rounded to nearest. */
+template<typename Sum> static Sum average(Sum sum, size_t count)
+{
+  if constexpr (std::is_floating_point_v<Sum>) {
+    return sum / Sum(count);
+  }
+  else {
+    return (sum + Sum(count / 2)) / Sum(count);
+  }
+}
+
+template<typename T, typename Sum>
+static void box_filter_row_scalar(T *dst, const T *src, size_t begin, size_t width, uint32_t n)
+{
+  for (size_t x = begin; x < width; x += n) {
+    size_t count = std::min(size_t(n), width - x);
+    Sum sum = 0;
+    for (size_t i = 0; i < count; i++) {
+      sum += src[x + i];
+    }
+    dst[x / n] = T(average(sum, count));
+  }
+}
+
+#if PSD_SIMD_X86
+
+/* PSADBW against zero sums 8 bytes at a time, which covers every box of 8 bytes or more. Smaller
+ * boxes are left to the scalar loop. */
+static void box_filter_row_8_sse2(uint8_t *dst, const uint8_t *src, size_t width, uint32_t n)
+{
+  if (n < 8) {
+    box_filter_row_scalar<uint8_t, uint32_t>(dst, src, 0, width, n);
+    return;
+  }
+  const __m128i zero = _mm_setzero_si128();
+  int shift = std::countr_zero(n);
+  size_t x = 0;
+  for (; x + n <= width; x += n) {
+    __m128i sums = zero;
+    for (size_t i = 0; i < n; i += 8) {
+      __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + x + i));
+      sums = _mm_add_epi64(sums, _mm_sad_epu8(bytes, zero));
+    }
+    uint32_t sum = uint32_t(_mm_cvtsi128_si32(sums));
+    dst[x / n] = uint8_t((sum + n / 2) >> shift);
+  }
+  box_filter_row_scalar<uint8_t, uint32_t>(dst, src, x, width, n);
+}
+
+#endif
+
+void box_filter_row_8(
+    uint8_t *dst, const uint8_t *src, size_t width, uint32_t reduction, SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level != SIMDLevel::Scalar) {
+    box_filter_row_8_sse2(dst, src, width, reduction);
+    return;
+  }
+#endif
+  box_filter_row_scalar<uint8_t, uint32_t>(dst, src, 0, width, reduction);
+}
+
+void box_filter_row_8(uint8_t *dst, const uint8_t *src, size_t width, uint32_t reduction)
+{
+  box_filter_row_8(dst, src, width, reduction, simd_level());
+}
+
+void box_filter_row_16(uint16_t *dst, const uint16_t *src, size_t width, uint32_t reduction)
+{
+  box_filter_row_scalar<uint16_t, uint64_t>(dst, src, 0, width, reduction);
+}
+
+void box_filter_row_32(float *dst, const float *src, size_t width, uint32_t reduction)
+{
+  box_filter_row_scalar<float, double>(dst, src, 0, width, reduction);
+}
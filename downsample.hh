@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hh"
+
+/* Horizontal box filters for reduced-resolution previews, one scanline at a time. Every
+ * `reduction` samples of `src` (a power of two) are averaged into one sample of `dst`, rounded to
+ * nearest. The box at the end of a row averages whatever samples are left, so `dst` receives
+ * calc_reduced_size(width, reduction) samples. */
+
+inline size_t calc_reduced_size(size_t size, uint32_t reduction)
+{
+  return (size + reduction - 1) / reduction;
+}
+
+void box_filter_row_8(uint8_t *dst, const uint8_t *src, size_t width, uint32_t reduction);
+void box_filter_row_8(
+    uint8_t *dst, const uint8_t *src, size_t width, uint32_t reduction, SIMDLevel level);
+
+/* 16-bit integer and 32-bit float samples in native byte order. These are scalar, the 8-bit
+ * kernel is the one previews of common documents spend their time in. */
+void box_filter_row_16(uint16_t *dst, const uint16_t *src, size_t width, uint32_t reduction);
+void box_filter_row_32(float *dst, const float *src, size_t width, uint32_t reduction);
@@ -0,0 +1,198 @@
+#include "interleave.hh"
+
+template<typename T>
+static void interleave_rgba_scalar(T *dst,
+                                   const T *r,
+                                   const T *g,
+                                   const T *b,
+                                   const T *a,
+                                   size_t begin,
+                                   size_t count)
+{
+  constexpr T opaque = T(~T(0));
+  for (size_t i = begin; i < count; i++) {
+    dst[i * 4 + 0] = r[i];
+    dst[i * 4 + 1] = g[i];
+    dst[i * 4 + 2] = b[i];
+    dst[i * 4 + 3] = a ? a[i] : opaque;
+  }
+}
+
+#if PSD_SIMD_X86
+
+static __m128i load_128(const void *src)
+{
+  return _mm_loadu_si128(static_cast<const __m128i *>(src));
+}
+
+static void store_128(void *dst, __m128i v)
+{
+  _mm_storeu_si128(static_cast<__m128i *>(dst), v);
+}
+
+static void interleave_rgba8_sse2(uint8_t *dst,
+                                  const uint8_t *r,
+                                  const uint8_t *g,
+                                  const uint8_t *b,
+                                  const uint8_t *a,
+                                  size_t count)
+{
+  const __m128i opaque = _mm_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i vr = load_128(r + i), vg = load_128(g + i), vb = load_128(b + i);
+    __m128i va = a ? load_128(a + i) : opaque;
+    __m128i rg_lo = _mm_unpacklo_epi8(vr, vg), rg_hi = _mm_unpackhi_epi8(vr, vg);
+    __m128i ba_lo = _mm_unpacklo_epi8(vb, va), ba_hi = _mm_unpackhi_epi8(vb, va);
+    uint8_t *out = dst + i * 4;
+    store_128(out + 0, _mm_unpacklo_epi16(rg_lo, ba_lo));
+    store_128(out + 16, _mm_unpackhi_epi16(rg_lo, ba_lo));
+    store_128(out + 32, _mm_unpacklo_epi16(rg_hi, ba_hi));
+    store_128(out + 48, _mm_unpackhi_epi16(rg_hi, ba_hi));
+  }
+  interleave_rgba_scalar(dst, r, g, b, a, i, count);
+}
+
+static void interleave_rgba16_sse2(uint16_t *dst,
+                                   const uint16_t *r,
+                                   const uint16_t *g,
+                                   const uint16_t *b,
+                                   const uint16_t *a,
+                                   size_t count)
+{
+  const __m128i opaque = _mm_set1_epi16(-1);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i vr = load_128(r + i), vg = load_128(g + i), vb = load_128(b + i);
+    __m128i va = a ? load_128(a + i) : opaque;
+    __m128i rg_lo = _mm_unpacklo_epi16(vr, vg), rg_hi = _mm_unpackhi_epi16(vr, vg);
+    __m128i ba_lo = _mm_unpacklo_epi16(vb, va), ba_hi = _mm_unpackhi_epi16(vb, va);
+    uint16_t *out = dst + i * 4;
+    store_128(out + 0, _mm_unpacklo_epi32(rg_lo, ba_lo));
+    store_128(out + 8, _mm_unpackhi_epi32(rg_lo, ba_lo));
+    store_128(out + 16, _mm_unpacklo_epi32(rg_hi, ba_hi));
+    store_128(out + 24, _mm_unpackhi_epi32(rg_hi, ba_hi));
+  }
+  interleave_rgba_scalar(dst, r, g, b, a, i, count);
+}
+
+/* The AVX2 unpacks work within 128-bit lanes, so each result holds two groups of pixels that are
+ * 16 (8-bit) or 8 (16-bit) pixels apart; the final lane permutes put them back in order. */
+
+PSD_TARGET_AVX2 static void interleave_rgba8_avx2(uint8_t *dst,
+                                                  const uint8_t *r,
+                                                  const uint8_t *g,
+                                                  const uint8_t *b,
+                                                  const uint8_t *a,
+                                                  size_t count)
+{
+  const __m256i opaque = _mm256_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i vr = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r + i));
+    __m256i vg = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(g + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    __m256i va = a ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)) : opaque;
+    __m256i rg_lo = _mm256_unpacklo_epi8(vr, vg), rg_hi = _mm256_unpackhi_epi8(vr, vg);
+    __m256i ba_lo = _mm256_unpacklo_epi8(vb, va), ba_hi = _mm256_unpackhi_epi8(vb, va);
+    __m256i p0 = _mm256_unpacklo_epi16(rg_lo, ba_lo), p1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);
+    __m256i p2 = _mm256_unpacklo_epi16(rg_hi, ba_hi), p3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);
+    __m256i *out = reinterpret_cast<__m256i *>(dst + i * 4);
+    _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+  }
+  interleave_rgba8_sse2(dst + i * 4, r + i, g + i, b + i, a ? a + i : nullptr, count - i);
+}
+
+PSD_TARGET_AVX2 static void interleave_rgba16_avx2(uint16_t *dst,
+                                                   const uint16_t *r,
+                                                   const uint16_t *g,
+                                                   const uint16_t *b,
+                                                   const uint16_t *a,
+                                                   size_t count)
+{
+  const __m256i opaque = _mm256_set1_epi16(-1);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i vr = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r + i));
+    __m256i vg = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(g + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    __m256i va = a ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)) : opaque;
+    __m256i rg_lo = _mm256_unpacklo_epi16(vr, vg), rg_hi = _mm256_unpackhi_epi16(vr, vg);
+    __m256i ba_lo = _mm256_unpacklo_epi16(vb, va), ba_hi = _mm256_unpackhi_epi16(vb, va);
+    __m256i q0 = _mm256_unpacklo_epi32(rg_lo, ba_lo), q1 = _mm256_unpackhi_epi32(rg_lo, ba_lo);
+    __m256i q2 = _mm256_unpacklo_epi32(rg_hi, ba_hi), q3 = _mm256_unpackhi_epi32(rg_hi, ba_hi);
+    __m256i *out = reinterpret_cast<__m256i *>(dst + i * 4);
+    _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(q0, q1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+  }
+  interleave_rgba16_sse2(dst + i * 4, r + i, g + i, b + i, a ? a + i : nullptr, count - i);
+}
+
+#endif
+
+void interleave_rgba8(uint8_t *dst,
+                      const uint8_t *r,
+                      const uint8_t *g,
+                      const uint8_t *b,
+                      const uint8_t *a,
+                      size_t count,
+                      SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    interleave_rgba8_avx2(dst, r, g, b, a, count);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    interleave_rgba8_sse2(dst, r, g, b, a, count);
+    return;
+  }
+#endif
+  interleave_rgba_scalar(dst, r, g, b, a, 0, count);
+}
+
+void interleave_rgba16(uint16_t *dst,
+                       const uint16_t *r,
+                       const uint16_t *g,
+                       const uint16_t *b,
+                       const uint16_t *a,
+                       size_t count,
+                       SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    interleave_rgba16_avx2(dst, r, g, b, a, count);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    interleave_rgba16_sse2(dst, r, g, b, a, count);
+    return;
+  }
+#endif
+  interleave_rgba_scalar(dst, r, g, b, a, 0, count);
+}
+
+void interleave_rgba8(uint8_t *dst,
+                      const uint8_t *r,
+                      const uint8_t *g,
+                      const uint8_t *b,
+                      const uint8_t *a,
+                      size_t count)
+{
+  interleave_rgba8(dst, r, g, b, a, count, simd_level());
+}
+
+void interleave_rgba16(uint16_t *dst,
+                       const uint16_t *r,
+                       const uint16_t *g,
+                       const uint16_t *b,
+                       const uint16_t *a,
+                       size_t count)
+{
+  interleave_rgba16(dst, r, g, b, a, count, simd_level());
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hh"
+
+/* Interleave `count` samples from four planes into RGBA pixels. `a` may be nullptr for opaque
+ * output, and the color planes may alias each other (grayscale passes the same plane three
+ * times). */
+void interleave_rgba8(uint8_t *dst,
+                      const uint8_t *r,
+                      const uint8_t *g,
+                      const uint8_t *b,
+                      const uint8_t *a,
+                      size_t count);
+void interleave_rgba8(uint8_t *dst,
+                      const uint8_t *r,
+                      const uint8_t *g,
+                      const uint8_t *b,
+                      const uint8_t *a,
+                      size_t count,
+                      SIMDLevel level);
+
+void interleave_rgba16(uint16_t *dst,
+                       const uint16_t *r,
+                       const uint16_t *g,
+                       const uint16_t *b,
+                       const uint16_t *a,
+                       size_t count);
+void interleave_rgba16(uint16_t *dst,
+                       const uint16_t *r,
+                       const uint16_t *g,
+                       const uint16_t *b,
+                       const uint16_t *a,
+                       size_t count,
+                       SIMDLevel level);
@@ -0,0 +1,489 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "blend.hh"
+#include "byteswap.hh"
+#include "packbits.hh"
+#include "predictor.hh"
+#include "simd.hh"
+
+#if PSD_SIMD_X86
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#endif
+
+/* Compare the scalar, SSE2 and AVX2 variants of each decoder kernel on working sets of
+ * increasing size:
+ *
+ *   kernel_bench [-r repetitions] [-s size,size,...] [kernel...]
+ *
+ * Sizes take K, M and G suffixes and default to 16K, 256K, 4M and 64M, meant to land in L1, L2,
+ * the last level cache and DRAM; pass larger ones on machines with a bigger last level cache.
+ * Naming kernels runs those whose name starts with one of the arguments. Levels above
+ * simd_level() are skipped, so PSD_SIMD caps them too.
+ *
+ * Every variant is first checked against the scalar output. Timings are the best of the
+ * repetitions (default 5), each running the kernel over the whole working set often enough to
+ * process at least 64 MB. On x86 they are read from the time stamp counter, which ticks at the
+ * nominal frequency and not the current one, so turbo and power states shift the numbers. */
+
+#if PSD_SIMD_X86
+static const char *const CYCLE_UNIT = "cycles/byte";
+
+static uint64_t read_cycles()
+{
+  return __rdtsc();
+}
+#else
+static const char *const CYCLE_UNIT = "ns/byte";
+
+static uint64_t read_cycles()
+{
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count());
+}
+#endif
+
+static const size_t MIN_BYTES_PER_SAMPLE = 64 << 20;
+
+/* Scanline width of the row kernels, in samples. */
+static const size_t ROW_WIDTH = 2048;
+
+struct Random {
+  uint64_t state;
+
+  uint32_t next()
+  {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return uint32_t((state * 0x2545F4914F6CDD1DULL) >> 32);
+  }
+};
+
+/* Runs of equal bytes mixed with noise, in proportions close to those of scanned artwork. */
+static void fill_image_like(std::span<uint8_t> r_bytes, uint32_t seed)
+{
+  Random random{0x9E3779B97F4A7C15ULL ^ seed};
+  size_t i = 0;
+  while (i < r_bytes.size()) {
+    size_t length = std::min<size_t>(1 + random.next() % 96, r_bytes.size() - i);
+    if (random.next() % 2) {
+      std::fill_n(r_bytes.data() + i, length, uint8_t(random.next()));
+    }
+    else {
+      for (size_t j = 0; j < length; j++) {
+        r_bytes[i + j] = uint8_t(random.next());
+      }
+    }
+    i += length;
+  }
+}
+
+/* A kernel with its buffers, set up for one working set size at a time. */
+class KernelBench {
+ public:
+  virtual ~KernelBench() = default;
+
+  virtual std::string name() const = 0;
+
+  /* Allocate and fill the buffers for a working set of about `size` bytes, and return how many
+   * bytes one run processes. That is the size of the input as stored in the file: encoded
+   * samples for the decoders, the layer planes for blending. */
+  virtual size_t prepare(size_t size) = 0;
+
+  /* Restore the inputs a run modifies in place. Only called before the correctness check, the
+   * timed runs keep working on their own output. */
+  virtual void reset() {}
+
+  virtual void run(SIMDLevel level) = 0;
+
+  virtual std::span<const uint8_t> output() const = 0;
+};
+
+class ByteswapBench : public KernelBench {
+  size_t element_size_;
+  std::vector<uint8_t> src_;
+  std::vector<uint8_t> dst_;
+
+ public:
+  ByteswapBench(size_t element_size) : element_size_(element_size)
+  {
+  }
+
+  std::string name() const override
+  {
+    return element_size_ == 2 ? "be_to_native_u16" : "be_to_native_u32";
+  }
+
+  size_t prepare(size_t size) override
+  {
+    size_t num_bytes = size / 2 / element_size_ * element_size_;
+    src_.resize(num_bytes);
+    dst_.assign(num_bytes, 0);
+    fill_image_like(src_, 1);
+    return num_bytes;
+  }
+
+  void run(SIMDLevel level) override
+  {
+    if (element_size_ == 2) {
+      be_to_native_u16(dst_.data(), src_.data(), src_.size() / 2, level);
+    }
+    else {
+      be_to_native_u32(dst_.data(), src_.data(), src_.size() / 4, level);
+    }
+  }
+
+  std::span<const uint8_t> output() const override
+  {
+    return dst_;
+  }
+};
+
+class PackBitsBench : public KernelBench {
+  std::vector<uint8_t> encoded_;
+  std::vector<uint8_t> decoded_;
+
+ public:
+  std::string name() const override
+  {
+    return "packbits_decode";
+  }
+
+  /* The working set is the stream plus the decoded bytes. Reported bytes are the decoded ones,
+   * since the compression ratio depends on the data. */
+  size_t prepare(size_t size) override
+  {
+    std::vector<uint8_t> source(size / 2);
+    fill_image_like(source, 2);
+    encoded_.resize(packbits_max_encoded_size(source.size()));
+    encoded_.resize(packbits_encode(encoded_.data(), source.data(), source.size()));
+    decoded_.assign(source.size(), 0);
+    return decoded_.size();
+  }
+
+  void run(SIMDLevel level) override
+  {
+    if (!packbits_decode(
+            decoded_.data(), decoded_.size(), encoded_.data(), encoded_.size(), level))
+    {
+      fprintf(stderr, "packbits_decode: the generated stream was rejected\n");
+      std::exit(1);
+    }
+  }
+
+  std::span<const uint8_t> output() const override
+  {
+    return decoded_;
+  }
+};
+
+class UnpredictBench : public KernelBench {
+  uint16_t depth_;
+  std::vector<uint8_t> deltas_;
+  std::vector<uint8_t> rows_;
+  std::vector<uint32_t> dst_;
+
+ public:
+  UnpredictBench(uint16_t depth) : depth_(depth)
+  {
+  }
+
+  std::string name() const override
+  {
+    return "unpredict_row_" + std::to_string(depth_);
+  }
+
+  size_t prepare(size_t size) override
+  {
+    size_t row_bytes = ROW_WIDTH * (depth_ / 8);
+    /* 32-bit rows are unpredicted from scratch space into a separate output. */
+    size_t num_rows = std::max<size_t>(1, size / (depth_ == 32 ? 2 : 1) / row_bytes);
+    deltas_.resize(num_rows * row_bytes);
+    fill_image_like(deltas_, 3);
+    rows_ = deltas_;
+    dst_.assign(depth_ == 32 ? num_rows * ROW_WIDTH : 0, 0);
+    return deltas_.size();
+  }
+
+  void reset() override
+  {
+    rows_ = deltas_;
+  }
+
+  void run(SIMDLevel level) override
+  {
+    size_t row_bytes = ROW_WIDTH * (depth_ / 8);
+    for (size_t row = 0; row * row_bytes < rows_.size(); row++) {
+      uint8_t *data = rows_.data() + row * row_bytes;
+      switch (depth_) {
+        case 8:
+          unpredict_row_8(data, ROW_WIDTH, level);
+          break;
+        case 16:
+          unpredict_row_16(reinterpret_cast<uint16_t *>(data), ROW_WIDTH, level);
+          break;
+        case 32:
+          unpredict_row_32(dst_.data() + row * ROW_WIDTH, data, ROW_WIDTH, level);
+          break;
+      }
+    }
+  }
+
+  std::span<const uint8_t> output() const override
+  {
+    if (depth_ == 32) {
+      return {reinterpret_cast<const uint8_t *>(dst_.data()), dst_.size() * 4};
+    }
+    return rows_;
+  }
+};
+
+class BlendBench : public KernelBench {
+  BlendMode mode_;
+  const char *mode_name_;
+  size_t count_ = 0;
+  std::vector<uint8_t> layer_;
+  std::vector<uint8_t> canvas_;
+  std::vector<uint8_t> initial_canvas_;
+
+ public:
+  BlendBench(BlendMode mode, const char *mode_name) : mode_(mode), mode_name_(mode_name)
+  {
+  }
+
+  std::string name() const override
+  {
+    return std::string("blend_") + mode_name_;
+  }
+
+  /* Layer and canvas are four planes each. */
+  size_t prepare(size_t size) override
+  {
+    count_ = std::max<size_t>(1, size / 8);
+    layer_.resize(count_ * 4);
+    initial_canvas_.resize(count_ * 4);
+    fill_image_like(layer_, 4);
+    fill_image_like(initial_canvas_, 5);
+    canvas_ = initial_canvas_;
+    return layer_.size();
+  }
+
+  void reset() override
+  {
+    canvas_ = initial_canvas_;
+  }
+
+  void run(SIMDLevel level) override
+  {
+    uint8_t *const dst[4] = {canvas_.data(),
+                             canvas_.data() + count_,
+                             canvas_.data() + count_ * 2,
+                             canvas_.data() + count_ * 3};
+    const uint8_t *const src[4] = {layer_.data(),
+                                   layer_.data() + count_,
+                                   layer_.data() + count_ * 2,
+                                   layer_.data() + count_ * 3};
+    blend_span_function(mode_, level)(dst, src, 200, count_);
+  }
+
+  std::span<const uint8_t> output() const override
+  {
+    return canvas_;
+  }
+};
+
+static std::vector<std::unique_ptr<KernelBench>> all_kernels()
+{
+  std::vector<std::unique_ptr<KernelBench>> kernels;
+  kernels.push_back(std::make_unique<ByteswapBench>(2));
+  kernels.push_back(std::make_unique<ByteswapBench>(4));
+  kernels.push_back(std::make_unique<PackBitsBench>());
+  kernels.push_back(std::make_unique<UnpredictBench>(8));
+  kernels.push_back(std::make_unique<UnpredictBench>(16));
+  kernels.push_back(std::make_unique<UnpredictBench>(32));
+  const std::pair<BlendMode, const char *> modes[] = {
+      {BlendMode::Normal, "normal"},
+      {BlendMode::Multiply, "multiply"},
+      {BlendMode::Screen, "screen"},
+      {BlendMode::Overlay, "overlay"},
+      {BlendMode::Darken, "darken"},
+      {BlendMode::Lighten, "lighten"},
+      {BlendMode::Difference, "difference"},
+      {BlendMode::Exclusion, "exclusion"},
+      {BlendMode::HardLight, "hard_light"},
+      {BlendMode::LinearDodge, "linear_dodge"},
+      {BlendMode::LinearBurn, "linear_burn"},
+  };
+  for (const auto &[mode, name] : modes) {
+    kernels.push_back(std::make_unique<BlendBench>(mode, name));
+  }
+  return kernels;
+}
+
+/* Parse "16K,256K,4M" into bytes. Returns false on a malformed list. */
+static bool parse_sizes(const char *list, std::vector<size_t> &r_sizes)
+{
+  r_sizes.clear();
+  while (*list) {
+    char *end;
+    unsigned long long value = std::strtoull(list, &end, 10);
+    if (end == list || value == 0) {
+      return false;
+    }
+    switch (*end) {
+      case 'K':
+      case 'k':
+        value <<= 10;
+        end++;
+        break;
+      case 'M':
+      case 'm':
+        value <<= 20;
+        end++;
+        break;
+      case 'G':
+      case 'g':
+        value <<= 30;
+        end++;
+        break;
+    }
+    if (*end == ',') {
+      end++;
+    }
+    else if (*end != '\0') {
+      return false;
+    }
+    r_sizes.push_back(size_t(value));
+    list = end;
+  }
+  return !r_sizes.empty();
+}
+
+static std::string format_size(size_t size)
+{
+  if (size >= (1 << 30) && size % (1 << 30) == 0) {
+    return std::to_string(size >> 30) + "G";
+  }
+  if (size >= (1 << 20) && size % (1 << 20) == 0) {
+    return std::to_string(size >> 20) + "M";
+  }
+  if (size >= (1 << 10) && size % (1 << 10) == 0) {
+    return std::to_string(size >> 10) + "K";
+  }
+  return std::to_string(size);
+}
+
+/* Best cycles per byte over `repetitions` samples. */
+static double cycles_per_byte(KernelBench &kernel,
+                              SIMDLevel level,
+                              size_t num_bytes,
+                              int repetitions)
+{
+  size_t runs_per_sample = std::max<size_t>(1, MIN_BYTES_PER_SAMPLE / num_bytes);
+  /* Warm up: fault the pages in and fill the caches the working set fits in. */
+  kernel.run(level);
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < repetitions; i++) {
+    uint64_t start = read_cycles();
+    for (size_t run = 0; run < runs_per_sample; run++) {
+      kernel.run(level);
+    }
+    best = std::min(best, read_cycles() - start);
+  }
+  return double(best) / double(runs_per_sample * num_bytes);
+}
+
+int main(int argc, char **argv)
+{
+  int repetitions = 5;
+  std::vector<size_t> sizes = {16 << 10, 256 << 10, 4 << 20, 64 << 20};
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repetitions = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      if (!parse_sizes(argv[++i], sizes)) {
+        fprintf(stderr, "kernel_bench: invalid size list \"%s\"\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: kernel_bench [-r repetitions] [-s size,size,...] [kernel...]\n");
+      return 1;
+    }
+    else {
+      names.push_back(argv[i]);
+    }
+  }
+
+  std::vector<SIMDLevel> levels;
+  for (int level = 0; level <= int(simd_level()); level++) {
+    levels.push_back(SIMDLevel(level));
+  }
+
+  printf("%s, best of %d\n\n", CYCLE_UNIT, repetitions);
+  printf("%-20s %6s", "kernel", "size");
+  for (SIMDLevel level : levels) {
+    printf(" %9s", simd_level_name(level));
+  }
+  printf(" %8s\n", "speedup");
+
+  bool all_match = true;
+  for (std::unique_ptr<KernelBench> &kernel : all_kernels()) {
+    std::string name = kernel->name();
+    if (!names.empty() && std::none_of(names.begin(), names.end(), [&](const std::string &n) {
+          return name.compare(0, n.size(), n) == 0;
+        }))
+    {
+      continue;
+    }
+    for (size_t size : sizes) {
+      size_t num_bytes = kernel->prepare(size);
+
+      std::vector<uint8_t> expected;
+      std::vector<SIMDLevel> mismatches;
+      for (SIMDLevel level : levels) {
+        kernel->reset();
+        kernel->run(level);
+        std::span<const uint8_t> output = kernel->output();
+        if (level == SIMDLevel::Scalar) {
+          expected.assign(output.begin(), output.end());
+        }
+        else if (!std::equal(output.begin(), output.end(), expected.begin(), expected.end())) {
+          mismatches.push_back(level);
+        }
+      }
+
+      printf("%-20s %6s", name.c_str(), format_size(size).c_str());
+      double scalar = 0;
+      double best = 0;
+      for (SIMDLevel level : levels) {
+        double value = cycles_per_byte(*kernel, level, num_bytes, repetitions);
+        scalar = level == SIMDLevel::Scalar ? value : scalar;
+        best = level == SIMDLevel::Scalar ? value : std::min(best, value);
+        printf(" %9.3f", value);
+      }
+      printf(" %7.2fx", scalar / best);
+      for (SIMDLevel level : mismatches) {
+        printf(" %s differs from scalar", simd_level_name(level));
+        all_match = false;
+      }
+      printf("\n");
+    }
+  }
+  return all_match ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include "packbits.hh"
+
+#include <algorithm>
+#include <cstring>
+
+/* Longest run a single header byte can describe. */
+static constexpr size_t MAX_RUN = 128;
+
+/* Exact decoder, also used for the tail of the vectorized ones. */
+static bool packbits_decode_scalar(uint8_t *dst,
+                                   uint8_t *dst_end,
+                                   const uint8_t *src,
+                                   const uint8_t *src_end)
+{
+  while (src < src_end) {
+    int8_t header = static_cast<int8_t>(*src++);
+    if (header >= 0) {
+      size_t n = size_t(header) + 1;
+      if (size_t(src_end - src) < n || size_t(dst_end - dst) < n) {
+        return false;
+      }
+      memcpy(dst, src, n);
+      src += n;
+      dst += n;
+    }
+    else if (header != -128) {
+      size_t n = 1 - ptrdiff_t(header);
+      if (src == src_end || size_t(dst_end - dst) < n) {
+        return false;
+      }
+      memset(dst, *src++, n);
+      dst += n;
+    }
+  }
+  return dst == dst_end;
+}
+
+#if PSD_SIMD_X86
+
+/* The vectorized decoders copy and fill whole 16/32 byte blocks, so they only run while a full
+ * MAX_RUN run plus its header is guaranteed to fit in both buffers. Bytes written past the end of
+ * a run are overwritten by the following runs. */
+
+static bool packbits_decode_sse2(uint8_t *dst,
+                                 uint8_t *dst_end,
+                                 const uint8_t *src,
+                                 const uint8_t *src_end)
+{
+  while (src_end - src > ptrdiff_t(MAX_RUN) && dst_end - dst >= ptrdiff_t(MAX_RUN)) {
+    int8_t header = static_cast<int8_t>(*src++);
+    if (header >= 0) {
+      size_t n = size_t(header) + 1;
+      for (size_t i = 0; i < n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+      }
+      src += n;
+      dst += n;
+    }
+    else if (header != -128) {
+      size_t n = 1 - ptrdiff_t(header);
+      __m128i v = _mm_set1_epi8(static_cast<char>(*src++));
+      for (size_t i = 0; i < n; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+      }
+      dst += n;
+    }
+  }
+  return packbits_decode_scalar(dst, dst_end, src, src_end);
+}
+
+PSD_TARGET_AVX2 static bool packbits_decode_avx2(uint8_t *dst,
+                                                 uint8_t *dst_end,
+                                                 const uint8_t *src,
+                                                 const uint8_t *src_end)
+{
+  while (src_end - src > ptrdiff_t(MAX_RUN) && dst_end - dst >= ptrdiff_t(MAX_RUN)) {
+    int8_t header = static_cast<int8_t>(*src++);
+    if (header >= 0) {
+      size_t n = size_t(header) + 1;
+      for (size_t i = 0; i < n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+      }
+      src += n;
+      dst += n;
+    }
+    else if (header != -128) {
+      size_t n = 1 - ptrdiff_t(header);
+      __m256i v = _mm256_set1_epi8(static_cast<char>(*src++));
+      for (size_t i = 0; i < n; i += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+      }
+      dst += n;
+    }
+  }
+  return packbits_decode_scalar(dst, dst_end, src, src_end);
+}
+
+#endif
+
+bool packbits_decode(
+    uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    return packbits_decode_avx2(dst, dst + dst_size, src, src + src_size);
+  }
+  if (level == SIMDLevel::SSE2) {
+    return packbits_decode_sse2(dst, dst + dst_size, src, src + src_size);
+  }
+#endif
+  return packbits_decode_scalar(dst, dst + dst_size, src, src + src_size);
+}
+
+bool packbits_decode(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+  return packbits_decode(dst, dst_size, src, src_size, simd_level());
+}
+
+bool packbits_decode_span(
+    uint8_t *dst, size_t offset, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+  const uint8_t *src_end = src + src_size;
+  while (dst_size > 0) {
+    if (src == src_end) {
+      return false;
+    }
+    int8_t header = static_cast<int8_t>(*src++);
+    if (header == -128) {
+      continue;
+    }
+    bool literal = header >= 0;
+    size_t n = literal ? size_t(header) + 1 : size_t(1 - ptrdiff_t(header));
+    size_t n_src = literal ? n : 1;
+    if (size_t(src_end - src) < n_src) {
+      return false;
+    }
+    if (offset >= n) {
+      offset -= n;
+      src += n_src;
+      continue;
+    }
+    size_t count = std::min(n - offset, dst_size);
+    if (literal) {
+      memcpy(dst, src + offset, count);
+    }
+    else {
+      memset(dst, *src, count);
+    }
+    src += n_src;
+    offset = 0;
+    dst += count;
+    dst_size -= count;
+  }
+  return true;
+}
+
+size_t packbits_encode(uint8_t *dst, const uint8_t *src, size_t src_size)
+{
+  uint8_t *dst_begin = dst;
+  const uint8_t *src_end = src + src_size;
+  const uint8_t *literal = src;
+  auto flush_literal = [&](const uint8_t *end) {
+    while (literal < end) {
+      size_t n = std::min(size_t(end - literal), MAX_RUN);
+      *dst++ = uint8_t(n - 1);
+      memcpy(dst, literal, n);
+      dst += n;
+      literal += n;
+    }
+  };
+  while (src < src_end) {
+    const uint8_t *run_end = src + 1;
+    while (run_end < src_end && *run_end == *src && size_t(run_end - src) < MAX_RUN) {
+      run_end++;
+    }
+    size_t run = size_t(run_end - src);
+    if (run >= 3) {
+      flush_literal(src);
+      *dst++ = uint8_t(1 - ptrdiff_t(run));
+      *dst++ = *src;
+      literal = run_end;
+    }
+    src = run_end;
+  }
+  flush_literal(src_end);
+  return size_t(dst - dst_begin);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hh"
+
+/* Decode a PackBits (Apple RLE) stream of `src_size` bytes into exactly `dst_size` bytes.
+ * Returns false if the stream is malformed, i.e. it would write past `dst_size`, ends in the
+ * middle of a run or does not fill `dst`. Nothing is read or written outside the given ranges. */
+bool packbits_decode(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+
+/* Same, with an explicit kernel instead of the one selected by simd_level(). */
+bool packbits_decode(
+    uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, SIMDLevel level);
+
+/* Decode only bytes [`offset`, `offset + dst_size`) of what the stream decodes to, stopping as
+ * soon as they are written. Runs before `offset` are skipped without being expanded, and the
+ * stream after the span is not validated. Returns false if the stream ends or is malformed before
+ * the span is complete. */
+bool packbits_decode_span(
+    uint8_t *dst, size_t offset, size_t dst_size, const uint8_t *src, size_t src_size);
+
+/* Upper bound of what packbits_encode() writes for `size` bytes. */
+inline size_t packbits_max_encoded_size(size_t size)
+{
+  return size + (size + 127) / 128;
+}
+
+/* Encode `src_size` bytes as PackBits into `dst`, which must have room for
+ * packbits_max_encoded_size() bytes. Returns the encoded size. Runs of three or more equal bytes
+ * are repeated, the rest is stored as literals, which is what Photoshop writes. */
+size_t packbits_encode(uint8_t *dst, const uint8_t *src, size_t src_size);
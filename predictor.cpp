@@ -0,0 +1,229 @@
+#include "predictor.hh"
+
+#include <cstring>
+#include <vector>
+
+static void unpredict_row_8_scalar(uint8_t *row, size_t width, uint8_t carry)
+{
+  for (size_t i = 0; i < width; i++) {
+    carry = uint8_t(carry + row[i]);
+    row[i] = carry;
+  }
+}
+
+static void unpredict_row_16_scalar(uint16_t *row, size_t width, uint16_t carry)
+{
+  for (size_t i = 0; i < width; i++) {
+    carry = uint16_t(carry + row[i]);
+    row[i] = carry;
+  }
+}
+
+static void unshuffle_planes_32_scalar(uint32_t *dst,
+                                       const uint8_t *src,
+                                       size_t begin,
+                                       size_t width)
+{
+  const uint8_t *p0 = src, *p1 = src + width, *p2 = src + 2 * width, *p3 = src + 3 * width;
+  for (size_t i = begin; i < width; i++) {
+    dst[i] = (uint32_t(p0[i]) << 24) | (uint32_t(p1[i]) << 16) | (uint32_t(p2[i]) << 8) |
+             uint32_t(p3[i]);
+  }
+}
+
+#if PSD_SIMD_X86
+
+/* Running sums use the usual log-step scheme: add the vector to itself shifted by 1, 2, 4, ...
+ * elements, then add the last sum of the previous vector. */
+
+static void unpredict_row_8_sse2(uint8_t *row, size_t width)
+{
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= width; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, carry);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), x);
+    /* Broadcast the last byte for the next block without going through memory. */
+    __m128i last = _mm_unpackhi_epi8(x, x);
+    carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(last, 0xFF), 0xFF);
+  }
+  unpredict_row_8_scalar(row + i, width - i, i > 0 ? row[i - 1] : 0);
+}
+
+static void unpredict_row_16_sse2(uint16_t *row, size_t width)
+{
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= width; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi16(x, carry);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), x);
+    carry = _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF);
+  }
+  unpredict_row_16_scalar(row + i, width - i, i > 0 ? row[i - 1] : 0);
+}
+
+/* Interleave the four byte planes into little-endian 32-bit values: byte 0 comes from the last
+ * plane, byte 3 from the first. */
+static void unshuffle_planes_32_sse2(uint32_t *dst, const uint8_t *src, size_t width)
+{
+  const uint8_t *p0 = src, *p1 = src + width, *p2 = src + 2 * width, *p3 = src + 3 * width;
+  size_t i = 0;
+  for (; i + 16 <= width; i += 16) {
+    __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p0 + i));
+    __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p1 + i));
+    __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p2 + i));
+    __m128i a3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p3 + i));
+    __m128i lo32 = _mm_unpacklo_epi8(a3, a2);
+    __m128i lo10 = _mm_unpacklo_epi8(a1, a0);
+    __m128i hi32 = _mm_unpackhi_epi8(a3, a2);
+    __m128i hi10 = _mm_unpackhi_epi8(a1, a0);
+    __m128i *out = reinterpret_cast<__m128i *>(dst + i);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo32, lo10));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo32, lo10));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi32, hi10));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi32, hi10));
+  }
+  unshuffle_planes_32_scalar(dst, src, i, width);
+}
+
+PSD_TARGET_AVX2 static void unpredict_row_8_avx2(uint8_t *row, size_t width)
+{
+  const __m256i last_byte = _mm256_set1_epi8(15);
+  __m256i carry = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= width; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+    /* The shifts stay within 128-bit lanes, add the low lane's total to the high lane. */
+    __m256i low_lane = _mm256_permute2x128_si256(x, x, 0x08);
+    x = _mm256_add_epi8(x, _mm256_shuffle_epi8(low_lane, last_byte));
+    x = _mm256_add_epi8(x, carry);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), x);
+    carry = _mm256_shuffle_epi8(_mm256_permute2x128_si256(x, x, 0x11), last_byte);
+  }
+  unpredict_row_8_scalar(row + i, width - i, i > 0 ? row[i - 1] : 0);
+}
+
+PSD_TARGET_AVX2 static void unpredict_row_16_avx2(uint16_t *row, size_t width)
+{
+  const __m256i last_word = _mm256_setr_epi8(14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14,
+                                             15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15, 14, 15,
+                                             14, 15, 14, 15, 14, 15);
+  __m256i carry = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= width; i += 16) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+    x = _mm256_add_epi16(x, _mm256_slli_si256(x, 2));
+    x = _mm256_add_epi16(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi16(x, _mm256_slli_si256(x, 8));
+    __m256i low_lane = _mm256_permute2x128_si256(x, x, 0x08);
+    x = _mm256_add_epi16(x, _mm256_shuffle_epi8(low_lane, last_word));
+    x = _mm256_add_epi16(x, carry);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), x);
+    carry = _mm256_shuffle_epi8(_mm256_permute2x128_si256(x, x, 0x11), last_word);
+  }
+  unpredict_row_16_scalar(row + i, width - i, i > 0 ? row[i - 1] : 0);
+}
+
+#endif
+
+void unpredict_row_8(uint8_t *row, size_t width, SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    unpredict_row_8_avx2(row, width);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    unpredict_row_8_sse2(row, width);
+    return;
+  }
+#endif
+  unpredict_row_8_scalar(row, width, 0);
+}
+
+void unpredict_row_16(uint16_t *row, size_t width, SIMDLevel level)
+{
+#if PSD_SIMD_X86
+  if (level == SIMDLevel::AVX2) {
+    unpredict_row_16_avx2(row, width);
+    return;
+  }
+  if (level == SIMDLevel::SSE2) {
+    unpredict_row_16_sse2(row, width);
+    return;
+  }
+#endif
+  unpredict_row_16_scalar(row, width, 0);
+}
+
+void unpredict_row_32(uint32_t *dst, uint8_t *src, size_t width, SIMDLevel level)
+{
+  unpredict_row_8(src, width * 4, level);
+#if PSD_SIMD_X86
+  if (level != SIMDLevel::Scalar) {
+    unshuffle_planes_32_sse2(dst, src, width);
+    return;
+  }
+#endif
+  unshuffle_planes_32_scalar(dst, src, 0, width);
+}
+
+void unpredict_row_8(uint8_t *row, size_t width)
+{
+  unpredict_row_8(row, width, simd_level());
+}
+
+void unpredict_row_16(uint16_t *row, size_t width)
+{
+  unpredict_row_16(row, width, simd_level());
+}
+
+void unpredict_row_32(uint32_t *dst, uint8_t *src, size_t width)
+{
+  unpredict_row_32(dst, src, width, simd_level());
+}
+
+void predict_row(uint8_t *row, size_t width, uint16_t depth)
+{
+  if (depth == 8) {
+    for (size_t i = width; i-- > 1;) {
+      row[i] = uint8_t(row[i] - row[i - 1]);
+    }
+  }
+  else if (depth == 16) {
+    for (size_t i = width; i-- > 1;) {
+      uint16_t cur = uint16_t(row[i * 2] << 8 | row[i * 2 + 1]);
+      uint16_t prev = uint16_t(row[i * 2 - 2] << 8 | row[i * 2 - 1]);
+      uint16_t delta = uint16_t(cur - prev);
+      row[i * 2] = uint8_t(delta >> 8);
+      row[i * 2 + 1] = uint8_t(delta);
+    }
+  }
+  else if (depth == 32) {
+    /* Scratch space reused across rows. */
+    thread_local std::vector<uint8_t> planes;
+    planes.resize(width * 4);
+    for (size_t i = 0; i < width; i++) {
+      for (size_t k = 0; k < 4; k++) {
+        planes[k * width + i] = row[i * 4 + k];
+      }
+    }
+    for (size_t i = planes.size(); i-- > 1;) {
+      planes[i] = uint8_t(planes[i] - planes[i - 1]);
+    }
+    memcpy(row, planes.data(), planes.size());
+  }
+}
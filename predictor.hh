@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd.hh"
+
+/* Undo the horizontal delta prediction used by Compression::ZIPPrediction, one scanline at a
+ * time. All kernels are exact, the SIMD ones compute the running sums in registers. */
+
+/* 8-bit: `row` holds `width` byte deltas and is replaced by the samples. */
+void unpredict_row_8(uint8_t *row, size_t width);
+void unpredict_row_8(uint8_t *row, size_t width, SIMDLevel level);
+
+/* 16-bit: `row` holds `width` deltas already converted to native byte order. */
+void unpredict_row_16(uint16_t *row, size_t width);
+void unpredict_row_16(uint16_t *row, size_t width, SIMDLevel level);
+
+/* 32-bit: `src` holds `width * 4` bytes, the big-endian bytes of each float split into four
+ * planes and delta coded as one byte sequence. `src` is used as scratch space. Writes `width`
+ * native-order 32-bit samples to `dst`. */
+void unpredict_row_32(uint32_t *dst, uint8_t *src, size_t width);
+void unpredict_row_32(uint32_t *dst, uint8_t *src, size_t width, SIMDLevel level);
+
+/* The inverse, for writing: replace the `width` big-endian samples of a `depth`-bit scanline with
+ * their deltas. 32-bit samples are split into byte planes first, like unpredict_row_32()
+ * expects. */
+void predict_row(uint8_t *row, size_t width, uint16_t depth);
@@ -0,0 +1,1348 @@
+#include "psd.hh"
+#include "async_reader.hh"
+#include "downsample.hh"
+#include "interleave.hh"
+#include "packbits.hh"
+#include "predictor.hh"
+#include "thread_pool.hh"
+#include "trace.hh"
+#include "zip.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+/* Vectors of these only move their elements when growing if moving can not throw. */
+static_assert(std::is_nothrow_move_constructible_v<ImageResource>);
+static_assert(std::is_nothrow_move_constructible_v<AdditionalLayerInfo>);
+
+#define IS_EVEN_OR_ZERO(x) (((x) & 1) == 0)
+#define IS_ODD(x) (((x) & 1) == 1)
+
+#define IS_STR_EQUAL(a, b, n) (memcmp((a), (b), (n)) == 0)
+
+bool all_zeros(const char *data, size_t size)
+{
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint8_t read_uint8(ByteCursor &in)
+{
+  return in.read_be<uint8_t>();
+}
+
+bool read_bool(ByteCursor &in)
+{
+  return in.read_be<uint8_t>() != 0;
+}
+
+uint16_t read_uint16(ByteCursor &in)
+{
+  return in.read_be<uint16_t>();
+}
+
+uint32_t read_uint32(ByteCursor &in)
+{
+  return in.read_be<uint32_t>();
+}
+
+uint64_t read_uint64(ByteCursor &in)
+{
+  return in.read_be<uint64_t>();
+}
+
+/* Lengths that are 32-bit in PSD and 64-bit in PSB. */
+uint64_t read_length(ByteCursor &in, const FileHeader &header)
+{
+  return header.is_psb() ? read_uint64(in) : read_uint32(in);
+}
+
+int16_t read_int16(ByteCursor &in)
+{
+  return in.read_be<int16_t>();
+}
+
+Rect read_rect(ByteCursor &in)
+{
+  Rect rect;
+  rect.top = read_uint32(in);
+  rect.left = read_uint32(in);
+  rect.bottom = read_uint32(in);
+  rect.right = read_uint32(in);
+  return rect;
+}
+
+BlendingRange read_blending_range(ByteCursor &in)
+{
+  BlendingRange range;
+  range.source = read_uint32(in);
+  range.destination = read_uint32(in);
+  return range;
+}
+
+double read_double(ByteCursor &in)
+{
+  return std::bit_cast<double>(in.read_be<uint64_t>());
+}
+
+FileHeader read_file_header(ByteCursor &in)
+{
+  FileHeader header;
+  in.read(header.signature, 4);
+  header.version = read_uint16(in);
+  in.read(header.reserved, 6);
+  header.num_channels = read_uint16(in);
+  header.height = read_uint32(in);
+  header.width = read_uint32(in);
+  header.depth = read_uint16(in);
+  header.color_mode = static_cast<ColorMode>(read_uint16(in));
+  if (!IS_STR_EQUAL(header.signature, "8BPS", 4)) {
+    throw InvalidSignature();
+  }
+  if (header.version != FILE_VERSION_PSD && header.version != FILE_VERSION_PSB) {
+    throw UnsupportedFormat();
+  }
+  return header;
+}
+
+std::pmr::vector<char> read_color_mode_data(ByteCursor &in, std::pmr::memory_resource *resource)
+{
+  std::pmr::vector<char> data(resource);
+  uint32_t size = read_uint32(in);
+  if (size > 0) {
+    data.resize(size);
+    in.read(data.data(), data.size());
+  }
+  return data;
+}
+
+/* Image resource blocks are "8BIM", a few older Photoshop variants and plug-ins use the others. */
+static bool is_image_resource_signature(const char signature[4])
+{
+  static const char *const signatures[] = {"8BIM", "MeSa", "PHUT", "AgHg", "DCSR"};
+  for (const char *known : signatures) {
+    if (IS_STR_EQUAL(signature, known, 4)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Throw if the next `size` bytes would run past `end`. */
+static void check_section_bound(const ByteCursor &in, uint64_t size, uint64_t end)
+{
+  if (in.tell() > end || size > end - in.tell()) {
+    throw UnexpectedEndOfFile();
+  }
+}
+
+ImageResource read_image_resource(ByteCursor &in,
+                                  uint64_t end,
+                                  std::pmr::memory_resource *resource)
+{
+  char signature[4];
+  check_section_bound(in, 4, end);
+  in.read(signature, 4);
+  if (!is_image_resource_signature(signature)) {
+    throw InvalidSignature();
+  }
+  ImageResource image_resource(resource);
+  memcpy(image_resource.signature, signature, 4);
+  check_section_bound(in, 3, end);
+  image_resource.id = read_uint16(in);
+  uint8_t name_length = read_uint8(in);
+  uint8_t padded_name_length = name_length;
+  // Make size even, specification says name is padded to even size (including length byte)
+  // that's why we check if name_length is even, instead of odd,
+  // we would have checked odd if we only padded name not including length byte
+  // the specification also states that a 0 length string is two bytes
+  // one length byte containing value 0, and a padding 0 byte to make total size even
+  if (IS_EVEN_OR_ZERO(name_length)) {
+    ++padded_name_length;
+  }
+  char name[256];
+  check_section_bound(in, padded_name_length + 4, end);
+  in.read(name, padded_name_length);
+  image_resource.name.assign(name, name_length);
+  uint32_t data_size = read_uint32(in);
+  if (data_size > 0) {
+    // Data is padded to even size, the pad byte is not part of the payload
+    uint64_t padded_data_size = IS_ODD(data_size) ? uint64_t(data_size) + 1 : data_size;
+    check_section_bound(in, padded_data_size, end);
+    image_resource.data = in.read_payload(data_size, resource);
+    in.skip(padded_data_size - data_size);
+  }
+  return image_resource;
+}
+
+ImageResources read_image_resources(ByteCursor &in, std::pmr::memory_resource *resource)
+{
+  ImageResources resources(resource);
+  uint32_t image_resources_size = read_uint32(in);
+  uint64_t end = in.tell() + image_resources_size;
+  while (in.tell() < end) {
+    uint64_t offset = in.tell();
+    try {
+      ImageResource image_resource = read_image_resource(in, end, resource);
+      resources.index.try_emplace(image_resource.id, uint32_t(resources.resources.size()));
+      resources.resources.push_back(std::move(image_resource));
+    }
+    catch (InvalidSignature &) {
+      /* Nothing after an unknown block can be trusted, keep what was read so far. */
+      PSD_TRACE_WARN("image_resources",
+                     "unknown resource signature at offset %llu, skipping the rest of the section",
+                     (unsigned long long)offset);
+      break;
+    }
+  }
+  in.seek(end);
+  return resources;
+}
+
+LayerMaskData read_layer_mask_data(ByteCursor &in)
+{
+  LayerMaskData layer_mask_data;
+  layer_mask_data.length = read_uint32(in);
+  if (layer_mask_data.length == 0) {
+    return layer_mask_data;
+  }
+  layer_mask_data.rect = read_rect(in);
+  layer_mask_data.default_color = read_uint8(in);
+  assert(layer_mask_data.default_color == 0 || layer_mask_data.default_color == 255);
+
+  layer_mask_data.flags = read_uint8(in);
+  if (layer_mask_data.mask_has_parameters_applied_to_it) {
+    layer_mask_data.mask_parameters_flags = read_uint8(in);
+
+    if (layer_mask_data.is_user_mask_density_present) {
+      layer_mask_data.user_mask_density = read_uint8(in);
+    }
+
+    if (layer_mask_data.is_user_mask_feather_present) {
+      layer_mask_data.user_mask_feather = read_double(in);
+    }
+
+    if (layer_mask_data.is_vector_mask_density_present) {
+      layer_mask_data.vector_mask_density = read_uint8(in);
+    }
+
+    if (layer_mask_data.is_vector_mask_feather_present) {
+      layer_mask_data.vector_mask_feather = read_double(in);
+    }
+  }
+  if (layer_mask_data.length == 20) {
+    layer_mask_data.padding = read_uint16(in);
+  }
+  else {
+    layer_mask_data.real_flags = read_uint8(in);
+    layer_mask_data.real_user_mask_background = read_uint8(in);
+    assert(layer_mask_data.real_user_mask_background == 0 ||
+           layer_mask_data.real_user_mask_background == 255);
+    layer_mask_data.real_rect = read_rect(in);
+  }
+
+  return layer_mask_data;
+}
+
+bool additional_layer_info_has_long_length(const char key[4])
+{
+  static const char *const keys[] = {
+      "LMsk", "Lr16", "Lr32", "Layr", "Mt16", "Mt32", "Mtrn", "Alph", "FMsk", "lnk2", "FEid",
+      "FXid", "PxSD"};
+  for (const char *long_key : keys) {
+    if (IS_STR_EQUAL(key, long_key, 4)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+AdditionalLayerInfo read_additional_layer_info(ByteCursor &in,
+                                               const FileHeader &header,
+                                               std::pmr::memory_resource *resource)
+{
+  AdditionalLayerInfo info(resource);
+  in.read(info.signature, 4);
+  assert(IS_STR_EQUAL(info.signature, "8BIM", 4) || IS_STR_EQUAL(info.signature, "8B64", 4));
+
+  in.read(info.key, 4);
+  info.data_length = additional_layer_info_has_long_length(info.key) ? read_length(in, header) :
+                                                                       read_uint32(in);
+  info.data = in.read_payload(info.data_length, resource);
+  return info;
+}
+
+LayerRecord read_layer_record(ByteCursor &in,
+                              const FileHeader &header,
+                              std::pmr::memory_resource *resource)
+{
+  LayerRecord record(resource);
+  record.rect = read_rect(in);
+  record.num_channels = read_uint16(in);
+  /* Each entry is a 2-byte id followed by a 4-byte (8-byte in PSB) length, decode them from one
+   * bulk read. */
+  size_t entry_size = header.is_psb() ? 10 : 6;
+  const uint8_t *channel_info_data = in.consume(record.num_channels * entry_size);
+  record.channel_info.resize(record.num_channels);
+  for (uint16_t i = 0; i < record.num_channels; i++) {
+    const uint8_t *entry = channel_info_data + i * entry_size;
+    record.channel_info[i].id = load_be<uint16_t>(entry);
+    record.channel_info[i].data_length = header.is_psb() ? load_be<uint64_t>(entry + 2) :
+                                                           load_be<uint32_t>(entry + 2);
+  }
+  in.read(record.blend_mode_signature, 4);
+  assert(std::string(record.blend_mode_signature, 4) == "8BIM");
+  in.read(record.blend_mode_key, 4);
+
+  record.opacity = read_uint8(in);
+  record.clipping = read_bool(in);
+  record.flags = read_uint8(in);
+  record.filler = read_uint8(in);
+  assert(record.filler == 0);
+
+  record.length_of_extra_data = read_uint32(in);
+  if (record.length_of_extra_data == 0) {
+    return record;
+  }
+
+  uint64_t offset = in.tell();
+  offset += record.length_of_extra_data;
+  record.layer_mask_data = read_layer_mask_data(in);
+
+  uint32_t num_read_bytes = 0;
+  record.layer_blending_ranges.length = read_uint32(in);
+  record.layer_blending_ranges.composite_gray_range = read_blending_range(in);
+  num_read_bytes += sizeof(BlendingRange);
+  std::pmr::vector<BlendingRange> &channel_ranges =
+      record.layer_blending_ranges.channel_blending_ranges;
+  channel_ranges.resize(record.num_channels);
+  static_assert(sizeof(BlendingRange) == 2 * sizeof(uint32_t));
+  in.read_be_array(reinterpret_cast<uint32_t *>(channel_ranges.data()), channel_ranges.size() * 2);
+  num_read_bytes += channel_ranges.size() * sizeof(BlendingRange);
+  PSD_TRACE_DEBUG("layer_record",
+                  "blending_ranges_read=%u blending_ranges_length=%u",
+                  num_read_bytes,
+                  record.layer_blending_ranges.length);
+  assert(num_read_bytes == record.layer_blending_ranges.length);
+
+  // Read Pascal style string padded to multiple of 4 bytes
+  uint8_t layer_name_length = read_uint8(in);
+  uint8_t layer_name_total_bytes = layer_name_length + 1;
+  if ((layer_name_total_bytes % 4) != 0) {
+    layer_name_total_bytes = ((layer_name_total_bytes / 4) + 1) * 4;
+  }
+  uint8_t layer_name_remaining_bytes = layer_name_total_bytes - 1;
+  char layer_name[256];
+  in.read(layer_name, layer_name_remaining_bytes);
+  record.layer_name.assign(layer_name, layer_name_length);
+  PSD_TRACE_DEBUG("layer_record",
+                  "name=\"%s\" name_length=%zu",
+                  record.layer_name.c_str(),
+                  record.layer_name.length());
+
+  while (in.tell() < offset) {
+    record.additional_layer_info.push_back(read_additional_layer_info(in, header, resource));
+  }
+  assert(in.tell() == offset);
+
+  return record;
+}
+
+size_t calc_row_size(uint32_t width, uint16_t depth)
+{
+  if (depth == 1) {
+    return (size_t(width) + 7) / 8;
+  }
+  return size_t(width) * (depth / 8);
+}
+
+/* Samples are stored big-endian, convert a decoded buffer to native order in place. */
+static void samples_to_native(uint8_t *data, size_t size, uint16_t depth)
+{
+  if (depth == 16) {
+    be_to_native_u16(data, data, size / 2);
+  }
+  else if (depth == 32) {
+    be_to_native_u32(data, data, size / 4);
+  }
+}
+
+/* RLE data starts with the compressed size of every scanline, 16-bit in PSD and 32-bit in PSB. */
+static void read_rle_byte_counts(ByteCursor &in,
+                                 uint32_t *dst,
+                                 size_t count,
+                                 const FileHeader &header)
+{
+  if (header.is_psb()) {
+    in.read_be_array(dst, count);
+    return;
+  }
+  /* Byteswap with the bulk kernel, then widen, which the compiler vectorizes. */
+  thread_local std::vector<uint16_t> counts;
+  counts.resize(count);
+  in.read_be_array(counts.data(), count);
+  std::copy(counts.begin(), counts.end(), dst);
+}
+
+static void read_rle_rows(
+    ByteCursor &in, uint8_t *dst, size_t num_rows, size_t row_size, const FileHeader &header)
+{
+  /* Scratch space reused across channels, so decoding does not allocate per channel. */
+  thread_local std::vector<uint32_t> byte_counts;
+  byte_counts.resize(num_rows);
+  read_rle_byte_counts(in, byte_counts.data(), byte_counts.size(), header);
+  for (uint32_t n : byte_counts) {
+    if (!packbits_decode(dst, row_size, in.consume(n), n)) {
+      throw InvalidCompressedData();
+    }
+    dst += row_size;
+  }
+}
+
+static void decode_zip(const uint8_t *src,
+                       size_t src_size,
+                       uint8_t *dst,
+                       size_t num_rows,
+                       size_t row_size,
+                       uint32_t width,
+                       uint16_t depth,
+                       bool prediction)
+{
+  size_t size = num_rows * row_size;
+  if (prediction && depth == 32) {
+    /* Inflate the byte planes to scratch space, un-prediction interleaves them into `dst`. */
+    std::vector<uint8_t> planes(size);
+    if (!zip_decompress(planes.data(), size, src, src_size)) {
+      throw InvalidCompressedData();
+    }
+    for (size_t y = 0; y < num_rows; y++) {
+      unpredict_row_32(
+          reinterpret_cast<uint32_t *>(dst + y * row_size), planes.data() + y * row_size, width);
+    }
+    return;
+  }
+
+  if (!zip_decompress(dst, size, src, src_size)) {
+    throw InvalidCompressedData();
+  }
+  samples_to_native(dst, size, depth);
+  if (!prediction) {
+    return;
+  }
+  for (size_t y = 0; y < num_rows; y++) {
+    if (depth == 16) {
+      unpredict_row_16(reinterpret_cast<uint16_t *>(dst + y * row_size), width);
+    }
+    else if (depth == 8) {
+      unpredict_row_8(dst + y * row_size, width);
+    }
+  }
+}
+
+/* Bytes of decoded samples in a channel covering `rect`. */
+static size_t calc_channel_size(const Rect &rect, uint16_t depth)
+{
+  return rect.calc_num_scan_lines() * calc_row_size(rect.calc_width(), depth);
+}
+
+/* Decode a channel into `r_channel`, whose data must already have calc_channel_size() bytes. This
+ * does not allocate from the document's memory resource, so it can run on any thread. */
+static void decode_channel_image_data(ByteCursor &in,
+                                      const Rect &rect,
+                                      uint64_t data_length,
+                                      const FileHeader &header,
+                                      ChannelImageData &r_channel)
+{
+  uint16_t depth = header.depth;
+  uint64_t end = in.tell() + data_length;
+  r_channel.compression = static_cast<Compression>(read_uint16(in));
+  PSD_TRACE_DEBUG("channel",
+                  "compression=%d size=%llu",
+                  int(r_channel.compression),
+                  static_cast<unsigned long long>(rect.calc_size()));
+
+  size_t num_rows = rect.calc_num_scan_lines();
+  size_t row_size = calc_row_size(rect.calc_width(), depth);
+  assert(r_channel.data.size() == num_rows * row_size);
+  uint8_t *data = reinterpret_cast<uint8_t *>(r_channel.data.data());
+  size_t size = r_channel.data.size();
+
+  switch (r_channel.compression) {
+    case Compression::Raw:
+      in.read(data, size);
+      samples_to_native(data, size, depth);
+      break;
+    case Compression::RLE:
+      read_rle_rows(in, data, num_rows, row_size, header);
+      samples_to_native(data, size, depth);
+      break;
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      /* The channel length includes the 2 byte compression type. */
+      if (data_length < sizeof(uint16_t)) {
+        throw InvalidCompressedData();
+      }
+      size_t src_size = data_length - sizeof(uint16_t);
+      const uint8_t *src = in.consume(src_size);
+      if (size > 0) {
+        decode_zip(src,
+                   src_size,
+                   data,
+                   num_rows,
+                   row_size,
+                   rect.calc_width(),
+                   depth,
+                   r_channel.compression == Compression::ZIPPrediction);
+      }
+      break;
+    }
+    default:
+      throw InvalidCompressedData();
+  }
+  assert(in.tell() == end);
+}
+
+ChannelImageData read_channel_image_data(ByteCursor &in,
+                                         const Rect &rect,
+                                         uint64_t data_length,
+                                         const FileHeader &header,
+                                         std::pmr::memory_resource *resource)
+{
+  ChannelImageData channel_image_data(resource);
+  channel_image_data.data.resize(calc_channel_size(rect, header.depth));
+  decode_channel_image_data(in, rect, data_length, header, channel_image_data);
+  return channel_image_data;
+}
+
+ChannelImageData read_channel_image_region(ByteCursor &in,
+                                           const Rect &rect,
+                                           uint64_t data_length,
+                                           const FileHeader &header,
+                                           const Rect &region,
+                                           std::pmr::memory_resource *resource)
+{
+  uint16_t depth = header.depth;
+  if (depth == 1) {
+    throw UnsupportedFormat();
+  }
+  /* The channel length includes the 2 byte compression type. */
+  if (data_length < sizeof(uint16_t)) {
+    throw InvalidCompressedData();
+  }
+  uint64_t start = in.tell();
+  uint64_t end = start + data_length;
+  ChannelImageData channel(resource);
+  channel.compression = static_cast<Compression>(read_uint16(in));
+
+  Rect roi = rect.calc_intersection(region);
+  size_t num_rows = rect.calc_num_scan_lines();
+  size_t row_size = calc_row_size(rect.calc_width(), depth);
+  size_t first_row = roi.top - rect.top;
+  size_t num_roi_rows = roi.calc_num_scan_lines();
+  size_t span_offset = calc_row_size(roi.left - rect.left, depth);
+  size_t span_size = calc_row_size(roi.calc_width(), depth);
+  channel.data.resize(num_roi_rows * span_size);
+  uint8_t *dst = reinterpret_cast<uint8_t *>(channel.data.data());
+  PSD_TRACE_DEBUG("channel",
+                  "compression=%d region rows=%zu+%zu bytes=%zu+%zu",
+                  int(channel.compression),
+                  first_row,
+                  num_roi_rows,
+                  span_offset,
+                  span_size);
+  if (channel.data.empty()) {
+    in.seek(end);
+    return channel;
+  }
+
+  switch (channel.compression) {
+    case Compression::Raw:
+      if (data_length - sizeof(uint16_t) < uint64_t(num_rows) * row_size) {
+        throw InvalidCompressedData();
+      }
+      for (size_t y = 0; y < num_roi_rows; y++) {
+        in.seek(start + sizeof(uint16_t) + (first_row + y) * row_size + span_offset);
+        in.read(dst + y * span_size, span_size);
+      }
+      samples_to_native(dst, channel.data.size(), depth);
+      break;
+    case Compression::RLE: {
+      thread_local std::vector<uint32_t> byte_counts;
+      byte_counts.resize(num_rows);
+      read_rle_byte_counts(in, byte_counts.data(), byte_counts.size(), header);
+      /* Rows are stored back to back, the first needed one starts after the sum of the counts
+       * before it. */
+      uint64_t offset = in.tell();
+      for (size_t y = 0; y < first_row; y++) {
+        offset += byte_counts[y];
+      }
+      /* A corrupt count table must not send the decoder into the next channel. */
+      uint64_t roi_end = offset;
+      for (size_t y = 0; y < num_roi_rows; y++) {
+        roi_end += byte_counts[first_row + y];
+      }
+      if (in.tell() > end || roi_end > end) {
+        throw InvalidCompressedData();
+      }
+      in.seek(offset);
+      for (size_t y = 0; y < num_roi_rows; y++) {
+        uint32_t n = byte_counts[first_row + y];
+        if (!packbits_decode_span(dst + y * span_size, span_offset, span_size, in.consume(n), n)) {
+          throw InvalidCompressedData();
+        }
+      }
+      samples_to_native(dst, channel.data.size(), depth);
+      break;
+    }
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      size_t src_size = data_length - sizeof(uint16_t);
+      std::vector<uint8_t> whole(num_rows * row_size);
+      decode_zip(in.consume(src_size),
+                 src_size,
+                 whole.data(),
+                 num_rows,
+                 row_size,
+                 rect.calc_width(),
+                 depth,
+                 channel.compression == Compression::ZIPPrediction);
+      for (size_t y = 0; y < num_roi_rows; y++) {
+        memcpy(dst + y * span_size,
+               whole.data() + (first_row + y) * row_size + span_offset,
+               span_size);
+      }
+      break;
+    }
+    default:
+      throw InvalidCompressedData();
+  }
+  in.seek(end);
+  return channel;
+}
+
+/* Previews average `reduction` samples with shifts, anything but a power of two is a caller
+ * error. */
+static void check_reduction(uint32_t reduction)
+{
+  if (!std::has_single_bit(reduction)) {
+    throw std::invalid_argument("preview reduction must be a power of two");
+  }
+}
+
+/* Box filter one scanline of native-order samples. */
+static void box_filter_row(
+    uint8_t *dst, const uint8_t *src, uint32_t width, uint16_t depth, uint32_t reduction)
+{
+  assert(std::has_single_bit(reduction));
+  if (depth == 8) {
+    box_filter_row_8(dst, src, width, reduction);
+  }
+  else if (depth == 16) {
+    box_filter_row_16(reinterpret_cast<uint16_t *>(dst),
+                      reinterpret_cast<const uint16_t *>(src),
+                      width,
+                      reduction);
+  }
+  else if (depth == 32) {
+    box_filter_row_32(reinterpret_cast<float *>(dst),
+                      reinterpret_cast<const float *>(src),
+                      width,
+                      reduction);
+  }
+}
+
+/* Decode every `reduction`th scanline of `num_planes` planes of `num_rows` scanlines each, stored
+ * back to back after the compression field (one layer channel, or all channels of the merged
+ * image), box filtering each into `r_planes`. The data must fit in `src_size` bytes. Leaves `in`
+ * after the data for raw and RLE. */
+static void decode_preview_planes(ByteCursor &in,
+                                  Compression compression,
+                                  uint64_t src_size,
+                                  size_t num_planes,
+                                  size_t num_rows,
+                                  uint32_t width,
+                                  const FileHeader &header,
+                                  uint32_t reduction,
+                                  uint8_t *const *r_planes)
+{
+  uint16_t depth = header.depth;
+  size_t row_size = calc_row_size(width, depth);
+  size_t preview_row_size = calc_row_size(calc_reduced_size(width, reduction), depth);
+  size_t total_rows = num_planes * num_rows;
+  auto preview_row = [&](size_t i) {
+    return r_planes[i / num_rows] + (i % num_rows) / reduction * preview_row_size;
+  };
+  /* Scratch space for one scanline, reused across calls. */
+  thread_local std::vector<uint8_t> row;
+  row.resize(row_size);
+
+  switch (compression) {
+    case Compression::Raw: {
+      if (uint64_t(total_rows) * row_size > src_size) {
+        throw InvalidCompressedData();
+      }
+      uint64_t start = in.tell();
+      for (size_t i = 0; i < total_rows; i++) {
+        if (i % num_rows % reduction == 0) {
+          in.seek(start + i * row_size);
+          in.read(row.data(), row_size);
+          samples_to_native(row.data(), row_size, depth);
+          box_filter_row(preview_row(i), row.data(), width, depth, reduction);
+        }
+      }
+      in.seek(start + total_rows * row_size);
+      break;
+    }
+    case Compression::RLE: {
+      /* Only the scanlines that are used are decoded, the byte counts give the offset of each. */
+      uint64_t end = in.tell() + src_size;
+      if (uint64_t(total_rows) * (header.is_psb() ? 4 : 2) > src_size) {
+        throw InvalidCompressedData();
+      }
+      std::vector<uint32_t> byte_counts(total_rows);
+      read_rle_byte_counts(in, byte_counts.data(), byte_counts.size(), header);
+      uint64_t offset = in.tell();
+      for (size_t i = 0; i < total_rows; i++) {
+        /* A corrupt count table must not send the decoder past the data. */
+        if (offset + byte_counts[i] > end) {
+          throw InvalidCompressedData();
+        }
+        if (i % num_rows % reduction == 0) {
+          in.seek(offset);
+          if (!packbits_decode(row.data(), row_size, in.consume(byte_counts[i]), byte_counts[i])) {
+            throw InvalidCompressedData();
+          }
+          samples_to_native(row.data(), row_size, depth);
+          box_filter_row(preview_row(i), row.data(), width, depth, reduction);
+        }
+        offset += byte_counts[i];
+      }
+      in.seek(offset);
+      break;
+    }
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      /* ZIP streams can not be entered midway, inflate everything. */
+      std::vector<uint8_t> planes(total_rows * row_size);
+      decode_zip(in.consume(src_size),
+                 src_size,
+                 planes.data(),
+                 total_rows,
+                 row_size,
+                 width,
+                 depth,
+                 compression == Compression::ZIPPrediction);
+      for (size_t i = 0; i < total_rows; i++) {
+        if (i % num_rows % reduction == 0) {
+          box_filter_row(preview_row(i), planes.data() + i * row_size, width, depth, reduction);
+        }
+      }
+      break;
+    }
+    default:
+      throw InvalidCompressedData();
+  }
+}
+
+ChannelImageData read_channel_image_preview(ByteCursor &in,
+                                            const Rect &rect,
+                                            uint64_t data_length,
+                                            const FileHeader &header,
+                                            uint32_t reduction,
+                                            std::pmr::memory_resource *resource)
+{
+  check_reduction(reduction);
+  if (header.depth == 1) {
+    throw UnsupportedFormat();
+  }
+  uint64_t end = in.tell() + data_length;
+  ChannelImageData channel(resource);
+  channel.compression = static_cast<Compression>(read_uint16(in));
+  size_t num_rows = rect.calc_num_scan_lines();
+  uint32_t width = rect.calc_width();
+  channel.data.resize(calc_reduced_size(num_rows, reduction) *
+                      calc_row_size(calc_reduced_size(width, reduction), header.depth));
+  if (!channel.data.empty()) {
+    if (data_length < sizeof(uint16_t)) {
+      throw InvalidCompressedData();
+    }
+    uint8_t *plane = reinterpret_cast<uint8_t *>(channel.data.data());
+    decode_preview_planes(in,
+                          channel.compression,
+                          data_length - sizeof(uint16_t),
+                          1,
+                          num_rows,
+                          width,
+                          header,
+                          reduction,
+                          &plane);
+  }
+  in.seek(end);
+  return channel;
+}
+
+LayerTable make_layer_table(const std::pmr::vector<LayerRecord> &records,
+                            std::pmr::memory_resource *resource)
+{
+  LayerTable table(resource);
+  table.rects.reserve(records.size());
+  table.blend_modes.reserve(records.size());
+  table.opacities.reserve(records.size());
+  table.flags.reserve(records.size());
+  table.clipping.reserve(records.size());
+  table.first_channel.reserve(records.size() + 1);
+  uint32_t num_channels = 0;
+  for (const LayerRecord &record : records) {
+    table.rects.push_back(record.rect);
+    table.blend_modes.push_back(
+        load_be<uint32_t>(reinterpret_cast<const uint8_t *>(record.blend_mode_key)));
+    table.opacities.push_back(record.opacity);
+    table.flags.push_back(record.flags);
+    table.clipping.push_back(record.clipping);
+    table.first_channel.push_back(num_channels);
+    num_channels += uint32_t(record.channel_info.size());
+  }
+  table.first_channel.push_back(num_channels);
+  return table;
+}
+
+const Rect &channel_rect(const LayerRecord &record, uint16_t channel_id)
+{
+  if (channel_id == CHANNEL_ID_USER_MASK) {
+    return record.layer_mask_data.rect;
+  }
+  if (channel_id == CHANNEL_ID_REAL_USER_MASK) {
+    return record.layer_mask_data.real_rect;
+  }
+  return record.rect;
+}
+
+/* Where one layer channel's data lives in the file. */
+struct ChannelTask {
+  uint64_t offset;
+  const Rect *rect;
+  uint64_t data_length;
+};
+
+/* Read channels through an AsyncReader, keeping reads for upcoming channels in flight (up to
+ * `read_ahead_bytes`) while the ones that arrived are decoded. */
+static void decode_channels_read_ahead(const ByteSource &source,
+                                       const std::vector<ChannelTask> &tasks,
+                                       const FileHeader &header,
+                                       const PSDReadOptions &options,
+                                       std::pmr::vector<ChannelImageData> &r_channels)
+{
+  std::vector<std::vector<uint8_t>> buffers(tasks.size());
+  /* Buffers of decoded channels are reused, so steady state reads do not allocate. */
+  std::vector<std::vector<uint8_t>> spare_buffers;
+  /* Declared after the buffers so it is destroyed, and its reads finished, before them. */
+  std::unique_ptr<AsyncReader> reader = AsyncReader::create(source);
+  PSD_TRACE_DEBUG("read_ahead", "reader=%s channels=%zu", reader->name(), tasks.size());
+
+  size_t next_submit = 0;
+  size_t num_decoded = 0;
+  uint64_t bytes_in_flight = 0;
+  std::vector<uint64_t> finished;
+  while (num_decoded < tasks.size()) {
+    /* Always allow one read so channels larger than the budget still make progress. */
+    while (next_submit < tasks.size() &&
+           (bytes_in_flight == 0 ||
+            bytes_in_flight + tasks[next_submit].data_length <= options.read_ahead_bytes))
+    {
+      const ChannelTask &task = tasks[next_submit];
+      if (!spare_buffers.empty()) {
+        buffers[next_submit] = std::move(spare_buffers.back());
+        spare_buffers.pop_back();
+      }
+      buffers[next_submit].resize(task.data_length);
+      reader->submit(next_submit, task.offset, task.data_length, buffers[next_submit].data());
+      bytes_in_flight += task.data_length;
+      next_submit++;
+    }
+
+    finished.clear();
+    reader->wait(finished);
+    auto decode = [&](size_t i) {
+      size_t index = size_t(finished[i]);
+      ByteSource channel_source{std::span<const uint8_t>(buffers[index])};
+      ByteCursor channel_in(channel_source);
+      decode_channel_image_data(
+          channel_in, *tasks[index].rect, tasks[index].data_length, header, r_channels[index]);
+    };
+    if (options.thread_pool) {
+      options.thread_pool->parallel_for(finished.size(), decode);
+    }
+    else {
+      for (size_t i = 0; i < finished.size(); i++) {
+        decode(i);
+      }
+    }
+    for (uint64_t index : finished) {
+      bytes_in_flight -= tasks[index].data_length;
+      spare_buffers.push_back(std::move(buffers[index]));
+    }
+    num_decoded += finished.size();
+  }
+}
+
+LayerInfo read_layer_info(ByteCursor &in, const FileHeader &header, const PSDReadOptions &options)
+{
+  std::pmr::memory_resource *resource = options.memory_resource;
+  LayerInfo info(resource);
+  info.length = read_length(in, header);
+  if (info.length == 0) {
+    return info;
+  }
+  info.layer_count = read_int16(in);
+  int16_t layer_count = std::abs(info.layer_count);
+
+  /* Reserve up front, growing a vector in a monotonic arena leaves the old buffers behind. */
+  info.layer_records.reserve(layer_count);
+  for (int16_t i = 0; i < layer_count; i++) {
+    info.layer_records.push_back(read_layer_record(in, header, resource));
+  }
+  info.table = make_layer_table(info.layer_records, resource);
+
+  /* Channel data follows the records back to back, so every channel's offset is known from the
+   * lengths in the records and the channels can be decoded independently. The lengths are
+   * checked against the file here, before any path sizes a buffer from them. */
+  uint64_t offset = in.tell();
+  uint64_t source_size = in.source().size();
+  info.channel_offsets.reserve(info.table.first_channel.back());
+  for (const LayerRecord &r : info.layer_records) {
+    for (const ChannelInfo &channel : r.channel_info) {
+      if (offset > source_size || channel.data_length > source_size - offset) {
+        throw UnexpectedEndOfFile();
+      }
+      info.channel_offsets.push_back(offset);
+      offset += channel.data_length;
+    }
+  }
+  if (options.skip_channel_data) {
+    in.seek(offset);
+    return info;
+  }
+  info.channel_image_data.reserve(info.table.first_channel.back());
+
+  if (options.thread_pool == nullptr && options.read_ahead_bytes == 0) {
+    for (const LayerRecord &r : info.layer_records) {
+      for (const ChannelInfo &channel : r.channel_info) {
+        info.channel_image_data.push_back(read_channel_image_data(
+            in, channel_rect(r, channel.id), channel.data_length, header, resource));
+      }
+    }
+    return info;
+  }
+
+  std::vector<ChannelTask> tasks;
+  tasks.reserve(info.channel_offsets.size());
+  for (const LayerRecord &r : info.layer_records) {
+    for (const ChannelInfo &channel : r.channel_info) {
+      tasks.push_back(
+          {info.channel_offsets[tasks.size()], &channel_rect(r, channel.id), channel.data_length});
+    }
+  }
+
+  /* Allocate on this thread, the memory resource is not required to be thread safe. */
+  for (const ChannelTask &task : tasks) {
+    ChannelImageData &channel = info.channel_image_data.emplace_back(resource);
+    channel.data.resize(calc_channel_size(*task.rect, header.depth));
+  }
+  if (options.read_ahead_bytes > 0) {
+    decode_channels_read_ahead(in.source(), tasks, header, options, info.channel_image_data);
+  }
+  else {
+    options.thread_pool->parallel_for(tasks.size(), [&](size_t i) {
+      ByteCursor channel_in(in.source(), tasks[i].offset);
+      decode_channel_image_data(
+          channel_in, *tasks[i].rect, tasks[i].data_length, header, info.channel_image_data[i]);
+    });
+  }
+  in.seek(offset);
+  return info;
+}
+
+LayerMaskInfo read_layer_and_mask_info(ByteCursor &in,
+                                       const FileHeader &header,
+                                       const PSDReadOptions &options)
+{
+  LayerMaskInfo info(options.memory_resource);
+  info.length = read_length(in, header);
+  uint64_t end = in.tell() + info.length;
+  if (info.length == 0) {
+    return info;
+  }
+  info.layer_info = read_layer_info(in, header, options);
+  /* Skip the global layer mask info and additional layer information we do not parse yet. */
+  in.seek(end);
+  return info;
+}
+
+/* Scanlines of the merged image decoded per task. */
+static constexpr size_t MERGED_ROWS_PER_TASK = 64;
+
+static void decode_merged_rle(ByteCursor &in,
+                              MergedImageData &image,
+                              size_t num_rows,
+                              size_t row_size,
+                              const FileHeader &header,
+                              const PSDReadOptions &options)
+{
+  /* The byte counts of every scanline of every channel come first, prefix sum them so each
+   * scanline can be found without decoding the previous ones. */
+  size_t total_rows = image.channels.size() * num_rows;
+  std::vector<uint32_t> byte_counts(total_rows);
+  read_rle_byte_counts(in, byte_counts.data(), byte_counts.size(), header);
+  std::vector<uint64_t> row_offsets(total_rows + 1);
+  row_offsets[0] = in.tell();
+  for (size_t i = 0; i < total_rows; i++) {
+    row_offsets[i + 1] = row_offsets[i] + byte_counts[i];
+  }
+
+  auto decode_rows = [&](size_t task) {
+    size_t begin = task * MERGED_ROWS_PER_TASK;
+    size_t end = std::min(begin + MERGED_ROWS_PER_TASK, total_rows);
+    ByteCursor rows_in(in.source(), row_offsets[begin]);
+    for (size_t i = begin; i < end; i++) {
+      ChannelImageData &channel = image.channels[i / num_rows];
+      uint8_t *dst = reinterpret_cast<uint8_t *>(channel.data.data()) + (i % num_rows) * row_size;
+      if (!packbits_decode(dst, row_size, rows_in.consume(byte_counts[i]), byte_counts[i])) {
+        throw InvalidCompressedData();
+      }
+    }
+  };
+  size_t num_tasks = (total_rows + MERGED_ROWS_PER_TASK - 1) / MERGED_ROWS_PER_TASK;
+  if (options.thread_pool) {
+    options.thread_pool->parallel_for(num_tasks, decode_rows);
+  }
+  else {
+    for (size_t task = 0; task < num_tasks; task++) {
+      decode_rows(task);
+    }
+  }
+  in.seek(row_offsets[total_rows]);
+}
+
+MergedImageData read_image_data(ByteCursor &in,
+                                const FileHeader &header,
+                                const PSDReadOptions &options)
+{
+  MergedImageData image(options.memory_resource);
+  image.compression = static_cast<Compression>(read_uint16(in));
+  size_t num_rows = header.height;
+  size_t row_size = calc_row_size(header.width, header.depth);
+  size_t plane_size = num_rows * row_size;
+  image.channels.reserve(header.num_channels);
+  for (uint16_t c = 0; c < header.num_channels; c++) {
+    ChannelImageData &channel = image.channels.emplace_back(options.memory_resource);
+    channel.compression = image.compression;
+    channel.data.resize(plane_size);
+  }
+
+  switch (image.compression) {
+    case Compression::Raw:
+      for (ChannelImageData &channel : image.channels) {
+        in.read(channel.data.data(), plane_size);
+      }
+      break;
+    case Compression::RLE:
+      decode_merged_rle(in, image, num_rows, row_size, header, options);
+      break;
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      /* All channels are one stream that runs to the end of the file. */
+      size_t src_size = in.source().size() - in.tell();
+      const uint8_t *src = in.consume(src_size);
+      std::vector<uint8_t> planes(plane_size * image.channels.size());
+      if (!planes.empty()) {
+        decode_zip(src,
+                   src_size,
+                   planes.data(),
+                   num_rows * image.channels.size(),
+                   row_size,
+                   header.width,
+                   header.depth,
+                   image.compression == Compression::ZIPPrediction);
+      }
+      for (size_t c = 0; c < image.channels.size(); c++) {
+        memcpy(image.channels[c].data.data(), planes.data() + c * plane_size, plane_size);
+      }
+      /* decode_zip() already converted the samples. */
+      return image;
+    }
+    default:
+      throw InvalidCompressedData();
+  }
+
+  for (ChannelImageData &channel : image.channels) {
+    samples_to_native(
+        reinterpret_cast<uint8_t *>(channel.data.data()), channel.data.size(), header.depth);
+  }
+  return image;
+}
+
+MergedImageData read_image_data_preview(ByteCursor &in,
+                                        const FileHeader &header,
+                                        uint32_t reduction,
+                                        std::pmr::memory_resource *resource)
+{
+  check_reduction(reduction);
+  if (header.depth == 1) {
+    throw UnsupportedFormat();
+  }
+  MergedImageData image(resource);
+  image.compression = static_cast<Compression>(read_uint16(in));
+  size_t plane_size = calc_reduced_size(header.height, reduction) *
+                      calc_row_size(calc_reduced_size(header.width, reduction), header.depth);
+  std::vector<uint8_t *> planes;
+  image.channels.reserve(header.num_channels);
+  for (uint16_t c = 0; c < header.num_channels; c++) {
+    ChannelImageData &channel = image.channels.emplace_back(resource);
+    channel.compression = image.compression;
+    channel.data.resize(plane_size);
+    planes.push_back(reinterpret_cast<uint8_t *>(channel.data.data()));
+  }
+  if (plane_size > 0) {
+    /* ZIP data runs to the end of the file. */
+    decode_preview_planes(in,
+                          image.compression,
+                          in.source().size() - in.tell(),
+                          planes.size(),
+                          header.height,
+                          header.width,
+                          header,
+                          reduction,
+                          planes.data());
+  }
+  return image;
+}
+
+PSDFile read_psd(ByteCursor &in, const PSDReadOptions &options)
+{
+  PSDFile psd(options.memory_resource);
+  psd.header = read_file_header(in);
+  psd.color_mode_data = read_color_mode_data(in, options.memory_resource);
+  psd.image_resources = read_image_resources(in, options.memory_resource);
+  psd.layer_mask_info = read_layer_and_mask_info(in, psd.header, options);
+  psd.image_data = read_image_data(in, psd.header, options);
+  return psd;
+}
+
+/* Pick the planes that make up RGBA, nullptr alpha means opaque. */
+template<typename T>
+static void merged_image_planes(const MergedImageData &image,
+                                const FileHeader &header,
+                                const T *r_planes[4])
+{
+  size_t num_color_channels;
+  if (header.color_mode == ColorMode::RGB) {
+    num_color_channels = 3;
+  }
+  else if (header.color_mode == ColorMode::Grayscale) {
+    num_color_channels = 1;
+  }
+  else {
+    throw UnsupportedFormat();
+  }
+  if (image.channels.size() < num_color_channels) {
+    throw UnsupportedFormat();
+  }
+  for (size_t i = 0; i < 3; i++) {
+    const ChannelImageData &channel = image.channels[num_color_channels == 3 ? i : 0];
+    r_planes[i] = reinterpret_cast<const T *>(channel.data.data());
+  }
+  r_planes[3] = image.channels.size() > num_color_channels ?
+                    reinterpret_cast<const T *>(image.channels[num_color_channels].data.data()) :
+                    nullptr;
+}
+
+std::vector<uint8_t> merged_image_rgba8(const MergedImageData &image, const FileHeader &header)
+{
+  if (header.depth != 8) {
+    throw UnsupportedFormat();
+  }
+  const uint8_t *planes[4];
+  merged_image_planes(image, header, planes);
+  size_t num_pixels = size_t(header.width) * header.height;
+  std::vector<uint8_t> pixels(num_pixels * 4);
+  interleave_rgba8(pixels.data(), planes[0], planes[1], planes[2], planes[3], num_pixels);
+  return pixels;
+}
+
+std::vector<uint16_t> merged_image_rgba16(const MergedImageData &image, const FileHeader &header)
+{
+  if (header.depth != 16) {
+    throw UnsupportedFormat();
+  }
+  const uint16_t *planes[4];
+  merged_image_planes(image, header, planes);
+  size_t num_pixels = size_t(header.width) * header.height;
+  std::vector<uint16_t> pixels(num_pixels * 4);
+  interleave_rgba16(pixels.data(), planes[0], planes[1], planes[2], planes[3], num_pixels);
+  return pixels;
+}
+
+void detach_from_source(PSDFile &psd)
+{
+  for (ImageResource &resource : psd.image_resources.resources) {
+    resource.data.detach();
+  }
+  for (LayerRecord &record : psd.layer_mask_info.layer_info.layer_records) {
+    for (AdditionalLayerInfo &info : record.additional_layer_info) {
+      info.data.detach();
+    }
+  }
+}
+
+/* Read a section length prefix and skip the section body, returning the range it covers. The
+ * prefix is 64-bit when `long_length` is set. */
+static SectionRange skip_section(ByteCursor &in, bool long_length = false)
+{
+  SectionRange range;
+  range.offset = in.tell();
+  uint64_t size = long_length ? read_uint64(in) : read_uint32(in);
+  in.skip(size);
+  range.length = in.tell() - range.offset;
+  return range;
+}
+
+PSDSectionIndex read_section_index(ByteCursor &in, FileHeader *r_header)
+{
+  PSDSectionIndex index;
+  index.header.offset = in.tell();
+  FileHeader header = read_file_header(in);
+  if (r_header) {
+    *r_header = header;
+  }
+  index.header.length = in.tell() - index.header.offset;
+  index.color_mode_data = skip_section(in);
+  index.image_resources = skip_section(in);
+  index.layer_and_mask_info = skip_section(in, header.is_psb());
+  index.image_data.offset = in.tell();
+  index.image_data.length = in.source().size() - in.tell();
+  return index;
+}
+
+/* Thumbnail resource data starts with this header, followed by the JFIF file. */
+static constexpr uint32_t THUMBNAIL_HEADER_SIZE = 28;
+static constexpr uint32_t THUMBNAIL_FORMAT_JFIF = 1;
+
+QuickLook read_quick_look(ByteCursor &in, std::pmr::memory_resource *resource)
+{
+  QuickLook quick_look;
+  quick_look.header = read_file_header(in);
+  skip_section(in);
+
+  /* Walk the image resource headers, skipping over their data. */
+  uint32_t image_resources_size = read_uint32(in);
+  uint64_t end = in.tell() + image_resources_size;
+  uint16_t thumbnail_id = 0;
+  uint64_t thumbnail_offset = 0;
+  uint32_t thumbnail_size = 0;
+  while (in.tell() < end && thumbnail_id != IMAGE_RESOURCE_THUMBNAIL) {
+    char signature[4];
+    check_section_bound(in, 4, end);
+    in.read(signature, 4);
+    if (!is_image_resource_signature(signature)) {
+      break;
+    }
+    check_section_bound(in, 3, end);
+    uint16_t id = read_uint16(in);
+    /* The name is padded to an even size including its length byte. */
+    uint8_t name_length = read_uint8(in);
+    uint32_t padded_name_length = IS_EVEN_OR_ZERO(name_length) ? name_length + 1 : name_length;
+    check_section_bound(in, padded_name_length + 4, end);
+    in.skip(padded_name_length);
+    uint32_t data_size = read_uint32(in);
+    check_section_bound(in, IS_ODD(data_size) ? uint64_t(data_size) + 1 : data_size, end);
+    if (id == IMAGE_RESOURCE_THUMBNAIL ||
+        (id == IMAGE_RESOURCE_THUMBNAIL_PS4 && thumbnail_id == 0))
+    {
+      thumbnail_id = id;
+      thumbnail_offset = in.tell();
+      thumbnail_size = data_size;
+    }
+    in.skip(IS_ODD(data_size) ? uint64_t(data_size) + 1 : data_size);
+  }
+  if (thumbnail_id == 0 || thumbnail_size < THUMBNAIL_HEADER_SIZE) {
+    return quick_look;
+  }
+
+  in.seek(thumbnail_offset);
+  Thumbnail thumbnail(resource);
+  thumbnail.resource_id = thumbnail_id;
+  uint32_t format = read_uint32(in);
+  thumbnail.width = read_uint32(in);
+  thumbnail.height = read_uint32(in);
+  /* Row size and uncompressed size. */
+  in.skip(8);
+  uint32_t compressed_size = read_uint32(in);
+  /* Bits per pixel and number of planes. */
+  in.skip(4);
+  if (format != THUMBNAIL_FORMAT_JFIF) {
+    PSD_TRACE_DEBUG("quick_look", "thumbnail format %u is not JFIF", format);
+    return quick_look;
+  }
+  if (compressed_size > thumbnail_size - THUMBNAIL_HEADER_SIZE) {
+    PSD_TRACE_WARN("quick_look",
+                   "thumbnail of %u bytes does not fit its resource of %u bytes",
+                   compressed_size,
+                   thumbnail_size);
+    return quick_look;
+  }
+  thumbnail.jfif = in.read_payload(compressed_size, resource);
+  quick_look.thumbnail = std::move(thumbnail);
+  return quick_look;
+}
+
+LazyPSDFile::LazyPSDFile(const ByteSource &source, const PSDReadOptions &options)
+    : source_(&source), options_(options)
+{
+  ByteCursor in(source);
+  index_ = read_section_index(in, &header_);
+}
+
+const std::pmr::vector<char> &LazyPSDFile::color_mode_data()
+{
+  if (!color_mode_data_) {
+    ByteCursor in(*source_, index_.color_mode_data.offset);
+    color_mode_data_ = read_color_mode_data(in, options_.memory_resource);
+  }
+  return *color_mode_data_;
+}
+
+const ImageResources &LazyPSDFile::image_resources()
+{
+  if (!image_resources_) {
+    ByteCursor in(*source_, index_.image_resources.offset);
+    image_resources_ = read_image_resources(in, options_.memory_resource);
+  }
+  return *image_resources_;
+}
+
+const LayerMaskInfo &LazyPSDFile::layer_mask_info()
+{
+  if (!layer_mask_info_) {
+    ByteCursor in(*source_, index_.layer_and_mask_info.offset);
+    layer_mask_info_ = read_layer_and_mask_info(in, header_, options_);
+  }
+  return *layer_mask_info_;
+}
+
+const MergedImageData &LazyPSDFile::image_data()
+{
+  if (!image_data_) {
+    ByteCursor in(*source_, index_.image_data.offset);
+    image_data_ = read_image_data(in, header_, options_);
+  }
+  return *image_data_;
+}
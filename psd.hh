@@ -0,0 +1,607 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "byte_source.hh"
+
+class ThreadPool;
+
+enum class ColorMode {
+  Bitmap = 0,
+  Grayscale = 1,
+  Indexed = 2,
+  RGB = 3,
+  CMYK = 4,
+  Multichannel = 7,
+  Duotone = 8,
+  Lab = 9,
+};
+
+enum class Compression {
+  Raw = 0,
+  RLE = 1,
+  ZIP = 2,
+  ZIPPrediction = 3,
+};
+
+/* FileHeader::version values. */
+enum FileVersion : uint16_t {
+  FILE_VERSION_PSD = 1,
+  /* Large Document Format (PSB), with 64-bit lengths in the layer and mask section and 32-bit
+   * RLE byte counts. */
+  FILE_VERSION_PSB = 2,
+};
+
+struct FileHeader {
+  char signature[4];
+  uint16_t version;
+  char reserved[6];
+  uint16_t num_channels;
+  uint32_t height;
+  uint32_t width;
+  uint16_t depth;
+  ColorMode color_mode;
+
+  bool is_psb() const
+  {
+    return version == FILE_VERSION_PSB;
+  }
+};
+
+/* Image resource IDs that are looked up directly. */
+enum ImageResourceID : uint16_t {
+  IMAGE_RESOURCE_THUMBNAIL_PS4 = 1033,
+  IMAGE_RESOURCE_THUMBNAIL = 1036,
+  IMAGE_RESOURCE_ICC_PROFILE = 1039,
+  IMAGE_RESOURCE_XMP = 1060,
+};
+
+/* The structs making up a parsed document allocate their containers from a std::pmr memory
+ * resource given at construction, see PSDReadOptions::memory_resource. */
+
+struct ImageResource {
+  explicit ImageResource(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : name(resource), data(resource)
+  {
+  }
+
+  /* "8BIM" or one of the other block signatures, see read_image_resource(). */
+  char signature[4] = {'8', 'B', 'I', 'M'};
+  uint16_t id;
+  std::pmr::string name;
+  /* Without the pad byte that follows odd sized data in the file. */
+  Payload data;
+};
+
+struct ImageResources {
+  explicit ImageResources(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : resources(resource), index(resource)
+  {
+  }
+
+  std::pmr::vector<ImageResource> resources;
+  /* Resource ID to position in `resources`, the first one wins if an ID is repeated. */
+  std::pmr::unordered_map<uint16_t, uint32_t> index;
+
+  /* Returns nullptr if there is no resource with this ID. */
+  const ImageResource *find(uint16_t id) const
+  {
+    auto it = index.find(id);
+    return it == index.end() ? nullptr : &resources[it->second];
+  }
+
+  size_t size() const
+  {
+    return resources.size();
+  }
+};
+
+/* Four character code as a big-endian integer, the form keys are stored in LayerTable. */
+constexpr uint32_t fourcc(const char (&code)[5])
+{
+  return uint32_t(uint8_t(code[0])) << 24 | uint32_t(uint8_t(code[1])) << 16 |
+         uint32_t(uint8_t(code[2])) << 8 | uint32_t(uint8_t(code[3]));
+}
+
+/* Special values of ChannelInfo::id, the others are color channel indices. */
+enum ChannelID : uint16_t {
+  CHANNEL_ID_TRANSPARENCY = 0xFFFF,    /* -1 */
+  CHANNEL_ID_USER_MASK = 0xFFFE,       /* -2 */
+  CHANNEL_ID_REAL_USER_MASK = 0xFFFD,  /* -3 */
+};
+
+struct ChannelInfo {
+  uint16_t id;
+  uint64_t data_length;
+};
+
+struct Rect {
+  uint32_t top, left, bottom, right;
+
+  /* Pixel count, PSB canvases can have more than 2^32 pixels. */
+  uint64_t calc_size() const
+  {
+    return uint64_t(bottom - top) * (right - left);
+  }
+
+  uint32_t calc_num_scan_lines() const
+  {
+    return bottom - top;
+  }
+
+  uint32_t calc_width() const
+  {
+    return right - left;
+  }
+
+  /* The part covered by both rectangles, empty at the top left corner of this one if they do not
+   * overlap. Coordinates are compared as signed, layers can start left of or above the canvas. */
+  Rect calc_intersection(const Rect &other) const
+  {
+    int32_t t = std::max(int32_t(top), int32_t(other.top));
+    int32_t l = std::max(int32_t(left), int32_t(other.left));
+    int32_t b = std::min(int32_t(bottom), int32_t(other.bottom));
+    int32_t r = std::min(int32_t(right), int32_t(other.right));
+    if (b <= t || r <= l) {
+      return {top, left, top, left};
+    }
+    return {uint32_t(t), uint32_t(l), uint32_t(b), uint32_t(r)};
+  }
+};
+
+struct LayerMaskData {
+  uint32_t length;
+  Rect rect;
+  uint8_t default_color;  // 0 or 255
+
+  // bit flags
+  union {
+    uint8_t flags;
+
+    struct {
+      uint8_t position_relative_to_layer : 1;
+      uint8_t layer_mask_disabled : 1;
+      uint8_t invert_layer_mask_when_blending : 1;  // Obsolete
+      uint8_t layer_mask_from_rendered_data : 1;
+      uint8_t mask_has_parameters_applied_to_it : 1;
+    };
+  };
+
+  // end of flags
+
+  // mask parameters flags, only present if bit 4 of flags above is set
+  union {
+
+    uint8_t mask_parameters_flags;
+
+    struct {
+      uint8_t is_user_mask_density_present : 1;
+      uint8_t is_user_mask_feather_present : 1;
+      uint8_t is_vector_mask_density_present : 1;
+      uint8_t is_vector_mask_feather_present : 1;
+    };
+  };
+
+  // end of mask parameters flags
+
+  uint8_t user_mask_density;
+  double user_mask_feather;
+  uint8_t vector_mask_density;
+  double vector_mask_feather;
+
+  uint16_t padding;    // Only present if data_size = 20. Otherwise the following is present
+  uint8_t real_flags;  // Same as flags above
+  uint8_t real_user_mask_background;  // 0 or 255
+  Rect real_rect;
+};
+
+struct BlendingRange {
+  uint32_t source, destination;
+};
+
+struct LayerBlendingRanges {
+  explicit LayerBlendingRanges(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : channel_blending_ranges(resource)
+  {
+  }
+
+  uint32_t length;
+  BlendingRange composite_gray_range;
+  std::pmr::vector<BlendingRange> channel_blending_ranges;
+};
+
+struct AdditionalLayerInfo {
+  explicit AdditionalLayerInfo(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : data(resource)
+  {
+  }
+
+  char signature[4];
+  char key[4];
+  uint64_t data_length;
+  Payload data;
+};
+
+/* Additional layer info keys whose length is 64-bit in PSB. */
+bool additional_layer_info_has_long_length(const char key[4]);
+
+struct LayerRecord {
+  explicit LayerRecord(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : channel_info(resource),
+        layer_blending_ranges(resource),
+        layer_name(resource),
+        additional_layer_info(resource)
+  {
+  }
+
+  Rect rect;
+  uint16_t num_channels;
+  std::pmr::vector<ChannelInfo> channel_info;
+  char blend_mode_signature[4];
+  char blend_mode_key[4];
+  uint8_t opacity;
+  bool clipping;
+
+  // bit flags
+  union {
+    uint8_t flags;
+
+    struct {
+      uint8_t transparency_protected : 1;
+      uint8_t visible : 1;
+      uint8_t obsolete : 1;
+      uint8_t is_bit_4_useful : 1;
+      uint8_t is_pixel_data_irrelevant : 1;
+    };
+  };
+
+  // end of flags
+  uint8_t filler;
+
+  uint32_t length_of_extra_data;
+  LayerMaskData layer_mask_data;
+  LayerBlendingRanges layer_blending_ranges;
+  std::pmr::string layer_name;
+  std::pmr::vector<AdditionalLayerInfo> additional_layer_info;
+};
+
+/* Bits of LayerRecord::flags. */
+enum LayerFlag : uint8_t {
+  LAYER_FLAG_TRANSPARENCY_PROTECTED = 1 << 0,
+  /* Called "visible" in the specification (and LayerRecord::visible), but Photoshop sets it for
+   * hidden layers. */
+  LAYER_FLAG_HIDDEN = 1 << 1,
+  LAYER_FLAG_OBSOLETE = 1 << 2,
+  LAYER_FLAG_IS_BIT_4_USEFUL = 1 << 3,
+  LAYER_FLAG_PIXEL_DATA_IRRELEVANT = 1 << 4,
+};
+
+/* The layer attributes needed on every render or hit test, one array each, so a scan over many
+ * layers only touches the bytes it reads instead of whole LayerRecords. Entry `i` describes
+ * LayerInfo::layer_records[i], which holds everything else. */
+struct LayerTable {
+  explicit LayerTable(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : rects(resource),
+        blend_modes(resource),
+        opacities(resource),
+        flags(resource),
+        clipping(resource),
+        first_channel(resource)
+  {
+  }
+
+  std::pmr::vector<Rect> rects;
+  /* LayerRecord::blend_mode_key as fourcc(). */
+  std::pmr::vector<uint32_t> blend_modes;
+  std::pmr::vector<uint8_t> opacities;
+  /* LayerFlag bits. */
+  std::pmr::vector<uint8_t> flags;
+  /* 1 if the layer is clipped to the layer below. */
+  std::pmr::vector<uint8_t> clipping;
+  /* Index of each layer's first channel in LayerInfo::channel_image_data, with one extra entry
+   * holding the total channel count. */
+  std::pmr::vector<uint32_t> first_channel;
+
+  size_t size() const
+  {
+    return rects.size();
+  }
+
+  bool is_visible(size_t i) const
+  {
+    return (flags[i] & LAYER_FLAG_HIDDEN) == 0;
+  }
+};
+
+/* Decoded samples, `depth` bits each in native byte order, scanline after scanline. */
+struct ChannelImageData {
+  explicit ChannelImageData(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : data(resource)
+  {
+  }
+
+  Compression compression;
+  std::pmr::vector<char> data;
+};
+
+struct LayerInfo {
+  explicit LayerInfo(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : layer_records(resource), table(resource), channel_offsets(resource),
+        channel_image_data(resource)
+  {
+  }
+
+  uint64_t length = 0;
+  /* Layer count. If it is a negative number, its absolute value is the number of layers and the
+   * first alpha channel contains the transparency data for the merged result. */
+  int16_t layer_count = 0;
+  std::pmr::vector<LayerRecord> layer_records;
+  /* Hot attributes of `layer_records`, see make_layer_table(). */
+  LayerTable table;
+  /* File offset of each channel's data, starting at its compression field, in the order of
+   * `channel_image_data`. Pass these to read_channel_image_region(). */
+  std::pmr::vector<uint64_t> channel_offsets;
+  /* Empty when read with PSDReadOptions::skip_channel_data. */
+  std::pmr::vector<ChannelImageData> channel_image_data;
+};
+
+struct LayerMaskInfo {
+  explicit LayerMaskInfo(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : layer_info(resource)
+  {
+  }
+
+  uint64_t length = 0;
+  LayerInfo layer_info;
+};
+
+/* The flattened composite stored after the layer and mask section. */
+struct MergedImageData {
+  explicit MergedImageData(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : channels(resource)
+  {
+  }
+
+  Compression compression;
+  /* One plane per header channel, laid out like layer channels (see ChannelImageData). */
+  std::pmr::vector<ChannelImageData> channels;
+};
+
+/* When read from a mapped ByteSource, image resource and additional layer info payloads point into
+ * the mapping; call detach_from_source() before the source is destroyed to keep them. */
+struct PSDFile {
+  explicit PSDFile(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : color_mode_data(resource),
+        image_resources(resource),
+        layer_mask_info(resource),
+        image_data(resource)
+  {
+  }
+
+  FileHeader header;
+  std::pmr::vector<char> color_mode_data;
+  ImageResources image_resources;
+  LayerMaskInfo layer_mask_info;
+  MergedImageData image_data;
+};
+
+/* Location of a top-level section. `offset` points at the section's length prefix (if it has one)
+ * and `length` covers the prefix and the section body. */
+struct SectionRange {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct PSDSectionIndex {
+  SectionRange header;
+  SectionRange color_mode_data;
+  SectionRange image_resources;
+  SectionRange layer_and_mask_info;
+  /* Merged image data, runs until the end of the file. */
+  SectionRange image_data;
+};
+
+/* Thumbnail image resource (IMAGE_RESOURCE_THUMBNAIL, or IMAGE_RESOURCE_THUMBNAIL_PS4 in files
+ * from Photoshop 4). */
+struct Thumbnail {
+  explicit Thumbnail(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : jfif(resource)
+  {
+  }
+
+  uint16_t resource_id;
+  uint32_t width;
+  uint32_t height;
+  /* The JFIF file, a view into the source when it is mapped. */
+  Payload jfif;
+
+  /* Photoshop 4 thumbnails store blue in the first JFIF channel and red in the last. */
+  bool is_bgr() const
+  {
+    return resource_id == IMAGE_RESOURCE_THUMBNAIL_PS4;
+  }
+};
+
+struct QuickLook {
+  FileHeader header;
+  /* Unset if the file has no thumbnail, or only an uncompressed one. */
+  std::optional<Thumbnail> thumbnail;
+};
+
+struct PSDReadOptions {
+  /* When set, layer channels are decoded concurrently on this pool. */
+  ThreadPool *thread_pool = nullptr;
+  /* When non-zero, layer channels are read ahead asynchronously (io_uring on Linux, a reader
+   * thread otherwise) while earlier ones decode, with at most this many bytes in flight. */
+  size_t read_ahead_bytes = 0;
+  /* Every container of the parsed document is allocated from this resource, which must outlive
+   * the result. Pass a std::pmr::monotonic_buffer_resource to parse into one arena and free the
+   * whole document at once. It is only used from the calling thread, so it needs no locking. */
+  std::pmr::memory_resource *memory_resource = std::pmr::get_default_resource();
+  /* Only read the layer records and channel offsets, leaving LayerInfo::channel_image_data empty,
+   * for callers that decode channels on demand with read_channel_image_region(). */
+  bool skip_channel_data = false;
+};
+
+class InvalidSignature : public std::exception {
+ public:
+  const char *what() const throw()
+  {
+    return "Invalid signature";
+  }
+};
+
+class UnsupportedFormat : public std::exception {
+ public:
+  const char *what() const throw()
+  {
+    return "Unsupported format";
+  }
+};
+
+class InvalidCompressedData : public std::exception {
+ public:
+  const char *what() const throw()
+  {
+    return "Invalid compressed data";
+  }
+};
+
+/* Throws InvalidSignature if this is not a PSD file and UnsupportedFormat for versions other than
+ * PSD and PSB. */
+FileHeader read_file_header(ByteCursor &in);
+std::pmr::vector<char> read_color_mode_data(
+    ByteCursor &in, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+/* `end` is where the image resource section ends. Throws InvalidSignature for an unknown block
+ * signature and UnexpectedEndOfFile if the block would run past `end`. */
+ImageResource read_image_resource(
+    ByteCursor &in,
+    uint64_t end,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+/* Stops at the first block with an unknown signature and skips the rest of the section. */
+ImageResources read_image_resources(
+    ByteCursor &in, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+LayerRecord read_layer_record(
+    ByteCursor &in,
+    const FileHeader &header,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+/* `rect` is the area covered by the channel (see channel_rect()) and `data_length` comes from its
+ * ChannelInfo. */
+ChannelImageData read_channel_image_data(
+    ByteCursor &in,
+    const Rect &rect,
+    uint64_t data_length,
+    const FileHeader &header,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+/* Decode only the part of a channel inside `region`, given in the same (canvas) coordinates as
+ * `rect`. The result covers rect.calc_intersection(region), row by row. For RLE the scanline byte
+ * counts locate the first needed row directly and only the needed columns of each row are
+ * written; raw channels are read row span by row span. ZIP streams can not be entered midway, so
+ * they are inflated completely to scratch space first. Bitmap (1-bit) channels throw
+ * UnsupportedFormat. */
+ChannelImageData read_channel_image_region(
+    ByteCursor &in,
+    const Rect &rect,
+    uint64_t data_length,
+    const FileHeader &header,
+    const Rect &region,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+/* Decode a preview of a channel reduced by `reduction`, a power of two: only every
+ * `reduction`th scanline is decoded (for RLE the others are skipped using the scanline byte
+ * counts) and box filtered horizontally in the same pass. The result has
+ * calc_reduced_size(height, reduction) rows of calc_reduced_size(width, reduction) samples (see
+ * downsample.hh). ZIP channels are inflated completely first. Bitmap (1-bit) channels throw
+ * UnsupportedFormat and any other `reduction` throws std::invalid_argument. */
+ChannelImageData read_channel_image_preview(
+    ByteCursor &in,
+    const Rect &rect,
+    uint64_t data_length,
+    const FileHeader &header,
+    uint32_t reduction,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+LayerInfo read_layer_info(ByteCursor &in,
+                          const FileHeader &header,
+                          const PSDReadOptions &options = {});
+LayerMaskInfo read_layer_and_mask_info(ByteCursor &in,
+                                       const FileHeader &header,
+                                       const PSDReadOptions &options = {});
+
+/* Build the table of hot layer attributes. read_layer_info() does this, call it again after
+ * changing the records. */
+LayerTable make_layer_table(
+    const std::pmr::vector<LayerRecord> &records,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+/* Bytes in one scanline of a channel, bitmap documents pack 8 pixels per byte. Shared by the
+ * reader and the writer. */
+size_t calc_row_size(uint32_t width, uint16_t depth);
+/* Mask channels cover the mask rectangle instead of the layer rectangle. */
+const Rect &channel_rect(const LayerRecord &record, uint16_t channel_id);
+MergedImageData read_image_data(ByteCursor &in,
+                                const FileHeader &header,
+                                const PSDReadOptions &options = {});
+/* The merged image reduced like read_channel_image_preview(), with every plane reduced to
+ * calc_reduced_size(header.width, reduction) by calc_reduced_size(header.height, reduction). */
+MergedImageData read_image_data_preview(
+    ByteCursor &in,
+    const FileHeader &header,
+    uint32_t reduction,
+    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+PSDFile read_psd(ByteCursor &in, const PSDReadOptions &options = {});
+
+/* Interleave an RGB or grayscale merged image into RGBA pixels, taking alpha from the first
+ * extra channel if there is one. The 8-bit version needs an 8-bit document and the 16-bit
+ * version a 16-bit one, anything else throws UnsupportedFormat. */
+std::vector<uint8_t> merged_image_rgba8(const MergedImageData &image, const FileHeader &header);
+std::vector<uint16_t> merged_image_rgba16(const MergedImageData &image, const FileHeader &header);
+
+/* Replace every payload view in `psd` with an owned copy. */
+void detach_from_source(PSDFile &psd);
+/* Record where each top-level section lives using only their length prefixes. */
+PSDSectionIndex read_section_index(ByteCursor &in, FileHeader *r_header = nullptr);
+/* Read the header and the thumbnail, preferring IMAGE_RESOURCE_THUMBNAIL over the Photoshop 4
+ * one. Only the color mode data length and the image resource headers are read on the way, the
+ * layer and mask section and the image data are never touched. */
+QuickLook read_quick_look(ByteCursor &in,
+                          std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+/* A PSD opened by only reading the header and the section length prefixes. Every other section is
+ * parsed the first time it is accessed and cached afterwards. Not thread safe. */
+class LazyPSDFile {
+ public:
+  explicit LazyPSDFile(const ByteSource &source, const PSDReadOptions &options = {});
+
+  const PSDSectionIndex &section_index() const
+  {
+    return index_;
+  }
+
+  const FileHeader &header() const
+  {
+    return header_;
+  }
+
+  const std::pmr::vector<char> &color_mode_data();
+  const ImageResources &image_resources();
+  const LayerMaskInfo &layer_mask_info();
+  const MergedImageData &image_data();
+
+ private:
+  const ByteSource *source_;
+  PSDReadOptions options_;
+  PSDSectionIndex index_;
+  FileHeader header_;
+  std::optional<std::pmr::vector<char>> color_mode_data_;
+  std::optional<ImageResources> image_resources_;
+  std::optional<LayerMaskInfo> layer_mask_info_;
+  std::optional<MergedImageData> image_data_;
+};
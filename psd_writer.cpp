@@ -0,0 +1,649 @@
+#include "psd_writer.hh"
+#include "byte_source.hh"
+#include "byteswap.hh"
+#include "packbits.hh"
+#include "predictor.hh"
+#include "thread_pool.hh"
+#include "trace.hh"
+#include "zip.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/* RLE and raw channels are encoded in blocks of scanlines of about this many bytes, so a large
+ * channel is split into several tasks. */
+static constexpr size_t ENCODE_BLOCK_SIZE = 256 * 1024;
+
+/* Samples are kept in native order and stored big-endian. */
+static void samples_to_big_endian(uint8_t *dst, const uint8_t *src, size_t size, uint16_t depth)
+{
+  if (depth == 16) {
+    be_to_native_u16(dst, src, size / 2);
+  }
+  else if (depth == 32) {
+    be_to_native_u32(dst, src, size / 4);
+  }
+  else {
+    memcpy(dst, src, size);
+  }
+}
+
+/* Encoded scanlines [begin, end) of a job. */
+struct EncodedBlock {
+  std::vector<uint8_t> bytes;
+  /* RLE only. */
+  std::vector<uint32_t> byte_counts;
+};
+
+/* The compressed data of a layer channel, or of all merged image planes, which share one table of
+ * RLE byte counts and one ZIP stream. */
+struct EncodeJob {
+  Compression compression;
+  uint32_t width;
+  size_t row_size;
+  /* Per plane. */
+  size_t num_rows;
+  std::vector<const uint8_t *> planes;
+  size_t rows_per_block;
+  std::vector<EncodedBlock> blocks;
+
+  size_t total_rows() const
+  {
+    return planes.size() * num_rows;
+  }
+
+  const uint8_t *row(size_t i) const
+  {
+    return planes[i / num_rows] + (i % num_rows) * row_size;
+  }
+
+  /* Without the compression field. */
+  uint64_t encoded_size(const FileHeader &header) const
+  {
+    uint64_t size = 0;
+    if (compression == Compression::RLE) {
+      size += total_rows() * (header.is_psb() ? 4 : 2);
+    }
+    for (const EncodedBlock &block : blocks) {
+      size += block.bytes.size();
+    }
+    return size;
+  }
+};
+
+static EncodeJob make_encode_job(Compression compression,
+                                 uint32_t width,
+                                 size_t num_rows,
+                                 const FileHeader &header)
+{
+  EncodeJob job;
+  job.compression = compression;
+  job.width = width;
+  job.row_size = calc_row_size(width, header.depth);
+  job.num_rows = num_rows;
+  if (compression == Compression::ZIPPrediction && header.depth == 1) {
+    throw UnsupportedFormat();
+  }
+  if (compression != Compression::Raw && compression != Compression::RLE &&
+      compression != Compression::ZIP && compression != Compression::ZIPPrediction)
+  {
+    throw UnsupportedFormat();
+  }
+  return job;
+}
+
+/* Split the job into blocks once all its planes are added. A ZIP stream can not be cut, it is
+ * always one block. */
+static void split_encode_job(EncodeJob &job)
+{
+  size_t total_rows = job.total_rows();
+  if (job.compression == Compression::ZIP || job.compression == Compression::ZIPPrediction) {
+    job.rows_per_block = std::max<size_t>(1, total_rows);
+    job.blocks.resize(1);
+    return;
+  }
+  job.rows_per_block = std::max<size_t>(1, ENCODE_BLOCK_SIZE / std::max<size_t>(1, job.row_size));
+  job.blocks.resize((total_rows + job.rows_per_block - 1) / job.rows_per_block);
+}
+
+static void encode_block(EncodeJob &job, size_t block_index, const FileHeader &header)
+{
+  EncodedBlock &block = job.blocks[block_index];
+  size_t begin = block_index * job.rows_per_block;
+  size_t end = std::min(begin + job.rows_per_block, job.total_rows());
+  size_t row_size = job.row_size;
+  switch (job.compression) {
+    case Compression::Raw:
+      block.bytes.resize((end - begin) * row_size);
+      for (size_t i = begin; i < end; i++) {
+        samples_to_big_endian(
+            block.bytes.data() + (i - begin) * row_size, job.row(i), row_size, header.depth);
+      }
+      break;
+    case Compression::RLE: {
+      /* Scratch space reused across blocks. */
+      thread_local std::vector<uint8_t> row;
+      row.resize(row_size);
+      size_t max_encoded_size = packbits_max_encoded_size(row_size);
+      block.byte_counts.resize(end - begin);
+      for (size_t i = begin; i < end; i++) {
+        samples_to_big_endian(row.data(), job.row(i), row_size, header.depth);
+        size_t offset = block.bytes.size();
+        block.bytes.resize(offset + max_encoded_size);
+        size_t n = packbits_encode(block.bytes.data() + offset, row.data(), row_size);
+        block.bytes.resize(offset + n);
+        if (!header.is_psb() && n > UINT16_MAX) {
+          throw UnsupportedFormat();
+        }
+        block.byte_counts[i - begin] = uint32_t(n);
+      }
+      break;
+    }
+    case Compression::ZIP:
+    case Compression::ZIPPrediction: {
+      std::vector<uint8_t> samples((end - begin) * row_size);
+      for (size_t i = begin; i < end; i++) {
+        uint8_t *dst = samples.data() + (i - begin) * row_size;
+        samples_to_big_endian(dst, job.row(i), row_size, header.depth);
+        if (job.compression == Compression::ZIPPrediction) {
+          predict_row(dst, job.width, header.depth);
+        }
+      }
+      if (!zip_compress(block.bytes, samples.data(), samples.size())) {
+        throw InvalidCompressedData();
+      }
+      break;
+    }
+  }
+}
+
+/* Encode the blocks of every job, concurrently when there is a thread pool. */
+static void encode_jobs(std::vector<EncodeJob> &jobs,
+                        const FileHeader &header,
+                        const PSDWriteOptions &options)
+{
+  std::vector<std::pair<size_t, size_t>> tasks;
+  for (size_t j = 0; j < jobs.size(); j++) {
+    for (size_t b = 0; b < jobs[j].blocks.size(); b++) {
+      tasks.emplace_back(j, b);
+    }
+  }
+  /* Start with the ZIP jobs, they can not be split and finish last otherwise. */
+  std::stable_partition(tasks.begin(), tasks.end(), [&](const std::pair<size_t, size_t> &task) {
+    Compression compression = jobs[task.first].compression;
+    return compression == Compression::ZIP || compression == Compression::ZIPPrediction;
+  });
+  PSD_TRACE_DEBUG("write", "encode jobs=%zu tasks=%zu", jobs.size(), tasks.size());
+  auto encode_task = [&](size_t i) {
+    encode_block(jobs[tasks[i].first], tasks[i].second, header);
+  };
+  if (options.thread_pool) {
+    options.thread_pool->parallel_for(tasks.size(), encode_task);
+  }
+  else {
+    for (size_t i = 0; i < tasks.size(); i++) {
+      encode_task(i);
+    }
+  }
+}
+
+/* The job's data, without the compression field. */
+static void write_encode_job(ByteWriter &out, const EncodeJob &job, const FileHeader &header)
+{
+  if (job.compression == Compression::RLE) {
+    for (const EncodedBlock &block : job.blocks) {
+      for (uint32_t n : block.byte_counts) {
+        if (header.is_psb()) {
+          out.u32(n);
+        }
+        else {
+          out.u16(uint16_t(n));
+        }
+      }
+    }
+  }
+  for (const EncodedBlock &block : job.blocks) {
+    out.bytes(block.bytes.data(), block.bytes.size());
+  }
+}
+
+static void write_double(ByteWriter &out, double v)
+{
+  out.u64(std::bit_cast<uint64_t>(v));
+}
+
+static void write_file_header(ByteWriter &out, const FileHeader &header)
+{
+  out.text("8BPS");
+  out.u16(header.version);
+  out.zeros(6);
+  out.u16(header.num_channels);
+  out.u32(header.height);
+  out.u32(header.width);
+  out.u16(header.depth);
+  out.u16(uint16_t(header.color_mode));
+}
+
+static void write_image_resources(ByteWriter &out, const ImageResources &resources)
+{
+  uint64_t section = out.begin_section(false);
+  for (const ImageResource &resource : resources.resources) {
+    out.bytes(resource.signature, 4);
+    out.u16(resource.id);
+    /* Pascal string padded to an even size, length byte included. */
+    size_t name_length = std::min<size_t>(resource.name.size(), 255);
+    out.u8(uint8_t(name_length));
+    out.bytes(resource.name.data(), name_length);
+    if (name_length % 2 == 0) {
+      out.u8(0);
+    }
+    out.u32(uint32_t(resource.data.size()));
+    out.bytes(resource.data.data(), resource.data.size());
+    if (resource.data.size() % 2 != 0) {
+      out.u8(0);
+    }
+  }
+  out.end_section(section, false);
+}
+
+static void write_layer_mask_data(ByteWriter &out, const LayerMaskData &mask)
+{
+  out.u32(mask.length);
+  if (mask.length == 0) {
+    return;
+  }
+  write_rect(out, mask.rect);
+  out.u8(mask.default_color);
+  out.u8(mask.flags);
+  if (mask.mask_has_parameters_applied_to_it) {
+    out.u8(mask.mask_parameters_flags);
+    if (mask.is_user_mask_density_present) {
+      out.u8(mask.user_mask_density);
+    }
+    if (mask.is_user_mask_feather_present) {
+      write_double(out, mask.user_mask_feather);
+    }
+    if (mask.is_vector_mask_density_present) {
+      out.u8(mask.vector_mask_density);
+    }
+    if (mask.is_vector_mask_feather_present) {
+      write_double(out, mask.vector_mask_feather);
+    }
+  }
+  if (mask.length == 20) {
+    out.u16(0);
+  }
+  else {
+    out.u8(mask.real_flags);
+    out.u8(mask.real_user_mask_background);
+    write_rect(out, mask.real_rect);
+  }
+}
+
+/* `channel_lengths` holds the data length of each channel of this record, compression field
+ * included. */
+static void write_layer_record(ByteWriter &out,
+                               const LayerRecord &record,
+                               const uint64_t *channel_lengths,
+                               const FileHeader &header)
+{
+  write_rect(out, record.rect);
+  out.u16(uint16_t(record.channel_info.size()));
+  for (size_t c = 0; c < record.channel_info.size(); c++) {
+    out.u16(record.channel_info[c].id);
+    out.length(channel_lengths[c], header.is_psb());
+  }
+  out.bytes(record.blend_mode_signature, 4);
+  out.bytes(record.blend_mode_key, 4);
+  out.u8(record.opacity);
+  out.u8(record.clipping ? 1 : 0);
+  out.u8(record.flags);
+  out.u8(0);
+
+  uint64_t extra = out.begin_section(false);
+  write_layer_mask_data(out, record.layer_mask_data);
+
+  /* The reader expects a range per channel after the composite one. */
+  const LayerBlendingRanges &ranges = record.layer_blending_ranges;
+  out.u32(uint32_t(8 * (1 + record.channel_info.size())));
+  out.u32(ranges.composite_gray_range.source);
+  out.u32(ranges.composite_gray_range.destination);
+  for (size_t c = 0; c < record.channel_info.size(); c++) {
+    BlendingRange range = c < ranges.channel_blending_ranges.size() ?
+                              ranges.channel_blending_ranges[c] :
+                              BlendingRange{0x0000FFFF, 0x0000FFFF};
+    out.u32(range.source);
+    out.u32(range.destination);
+  }
+
+  /* Pascal string padded to a multiple of 4 bytes, length byte included. */
+  size_t name_length = std::min<size_t>(record.layer_name.size(), 255);
+  out.u8(uint8_t(name_length));
+  out.bytes(record.layer_name.data(), name_length);
+  out.zeros(3 - name_length % 4);
+
+  for (const AdditionalLayerInfo &info : record.additional_layer_info) {
+    out.bytes(info.signature, 4);
+    out.bytes(info.key, 4);
+    if (additional_layer_info_has_long_length(info.key)) {
+      out.length(info.data.size(), header.is_psb());
+    }
+    else {
+      out.u32(uint32_t(info.data.size()));
+    }
+    out.bytes(info.data.data(), info.data.size());
+  }
+  out.end_section(extra, false);
+}
+
+static size_t count_channels(const LayerInfo &layers)
+{
+  size_t num_channels = 0;
+  for (const LayerRecord &record : layers.layer_records) {
+    num_channels += record.channel_info.size();
+  }
+  return num_channels;
+}
+
+static EncodeJob make_channel_job(const LayerRecord &record,
+                                  const ChannelInfo &info,
+                                  const ChannelImageData &channel,
+                                  const FileHeader &header,
+                                  const PSDWriteOptions &options)
+{
+  const Rect &rect = channel_rect(record, info.id);
+  EncodeJob job = make_encode_job(options.compression.value_or(channel.compression),
+                                  rect.calc_width(),
+                                  rect.calc_num_scan_lines(),
+                                  header);
+  if (channel.data.size() != job.num_rows * job.row_size) {
+    throw UnsupportedFormat();
+  }
+  job.planes.push_back(reinterpret_cast<const uint8_t *>(channel.data.data()));
+  split_encode_job(job);
+  return job;
+}
+
+static EncodeJob make_merged_job(const MergedImageData &image,
+                                 const FileHeader &header,
+                                 const PSDWriteOptions &options)
+{
+  if (image.channels.size() != header.num_channels) {
+    throw UnsupportedFormat();
+  }
+  EncodeJob job = make_encode_job(
+      options.compression.value_or(image.compression), header.width, header.height, header);
+  for (const ChannelImageData &channel : image.channels) {
+    if (channel.data.size() != job.num_rows * job.row_size) {
+      throw UnsupportedFormat();
+    }
+    job.planes.push_back(reinterpret_cast<const uint8_t *>(channel.data.data()));
+  }
+  split_encode_job(job);
+  return job;
+}
+
+/* Everything before the layer and mask information section. */
+static void write_leading_sections(ByteWriter &out, const PSDFile &psd)
+{
+  write_file_header(out, psd.header);
+  out.u32(uint32_t(psd.color_mode_data.size()));
+  out.bytes(psd.color_mode_data.data(), psd.color_mode_data.size());
+  write_image_resources(out, psd.image_resources);
+}
+
+/* The layer count and records, channel data follows them. */
+static void write_layer_records(ByteWriter &out,
+                                const LayerInfo &layers,
+                                const std::vector<uint64_t> &channel_lengths,
+                                const FileHeader &header)
+{
+  /* A negative count says the first alpha channel is the merged image transparency. */
+  int16_t layer_count = int16_t(layers.layer_records.size());
+  out.u16(uint16_t(layers.layer_count < 0 ? -layer_count : layer_count));
+  const uint64_t *record_lengths = channel_lengths.data();
+  for (const LayerRecord &record : layers.layer_records) {
+    write_layer_record(out, record, record_lengths, header);
+    record_lengths += record.channel_info.size();
+  }
+}
+
+void write_psd(ByteWriter &out, const PSDFile &psd, const PSDWriteOptions &options)
+{
+  const FileHeader &header = psd.header;
+  const LayerInfo &layers = psd.layer_mask_info.layer_info;
+  bool psb = header.is_psb();
+
+  /* One job per layer channel, then one for the merged image. Channel lengths are part of the
+   * layer records, so everything is encoded before the records are written. */
+  std::vector<EncodeJob> jobs;
+  size_t num_channels = count_channels(layers);
+  if (layers.channel_image_data.size() != num_channels) {
+    throw UnsupportedFormat();
+  }
+  jobs.reserve(num_channels + 1);
+  for (const LayerRecord &record : layers.layer_records) {
+    for (const ChannelInfo &info : record.channel_info) {
+      jobs.push_back(make_channel_job(
+          record, info, layers.channel_image_data[jobs.size()], header, options));
+    }
+  }
+  jobs.push_back(make_merged_job(psd.image_data, header, options));
+  const EncodeJob &merged = jobs.back();
+
+  encode_jobs(jobs, header, options);
+
+  write_leading_sections(out, psd);
+
+  uint64_t layer_and_mask_info = out.begin_section(psb);
+  uint64_t layer_info = out.begin_section(psb);
+  if (!layers.layer_records.empty()) {
+    std::vector<uint64_t> channel_lengths(num_channels);
+    for (size_t i = 0; i < num_channels; i++) {
+      channel_lengths[i] = sizeof(uint16_t) + jobs[i].encoded_size(header);
+    }
+    write_layer_records(out, layers, channel_lengths, header);
+    for (size_t i = 0; i < num_channels; i++) {
+      out.u16(uint16_t(jobs[i].compression));
+      write_encode_job(out, jobs[i], header);
+    }
+    if ((out.size() - layer_info) % 2 != 0) {
+      out.u8(0);
+    }
+  }
+  out.end_section(layer_info, psb);
+  /* No global layer mask info. */
+  out.u32(0);
+  out.end_section(layer_and_mask_info, psb);
+
+  out.u16(uint16_t(merged.compression));
+  write_encode_job(out, merged, header);
+}
+
+void write_psd(const std::filesystem::path &path,
+               const PSDFile &psd,
+               const PSDWriteOptions &options)
+{
+  ByteWriter out(path);
+  write_psd(out, psd, options);
+  out.finish();
+}
+
+void write_psd_incremental(ByteWriter &out,
+                           const ByteSource &source,
+                           const PSDFile &psd,
+                           const PSDEdits &edits,
+                           const PSDWriteOptions &options)
+{
+  const FileHeader &header = psd.header;
+  const LayerInfo &layers = psd.layer_mask_info.layer_info;
+  bool psb = header.is_psb();
+
+  /* Copied channels are only valid in a document with the same format and size. */
+  ByteCursor in(source);
+  FileHeader source_header;
+  PSDSectionIndex index = read_section_index(in, &source_header);
+  if (source_header.version != header.version || source_header.depth != header.depth ||
+      source_header.width != header.width || source_header.height != header.height ||
+      source_header.num_channels != header.num_channels)
+  {
+    throw UnsupportedFormat();
+  }
+
+  size_t num_channels = count_channels(layers);
+  if (layers.channel_offsets.size() != num_channels) {
+    throw UnsupportedFormat();
+  }
+  /* The copied ranges come from the offsets and the record lengths, they must describe the
+   * channel data of the source: back to back from where it starts in the source, inside the
+   * file. */
+  if (num_channels > 0) {
+    PSDReadOptions records_options;
+    records_options.skip_channel_data = true;
+    ByteCursor records_in(source, index.layer_and_mask_info.offset);
+    LayerMaskInfo source_layers = read_layer_and_mask_info(
+        records_in, source_header, records_options);
+    const std::pmr::vector<uint64_t> &source_offsets = source_layers.layer_info.channel_offsets;
+    if (source_offsets.empty() || source_offsets.front() != layers.channel_offsets.front()) {
+      throw UnsupportedFormat();
+    }
+    size_t i = 0;
+    for (const LayerRecord &record : layers.layer_records) {
+      for (const ChannelInfo &info : record.channel_info) {
+        uint64_t offset = layers.channel_offsets[i];
+        if (offset > source.size() || info.data_length > source.size() - offset ||
+            (i + 1 < num_channels && layers.channel_offsets[i + 1] != offset + info.data_length))
+        {
+          throw UnsupportedFormat();
+        }
+        i++;
+      }
+    }
+  }
+  std::vector<const ChannelImageData *> modified(num_channels, nullptr);
+  for (const ChannelEdit &edit : edits.channels) {
+    if (edit.channel >= num_channels || edit.data == nullptr) {
+      throw UnsupportedFormat();
+    }
+    modified[edit.channel] = edit.data;
+  }
+
+  /* Encode the modified channels and the merged image if it changed, the lengths of the other
+   * channels are the ones read from the source. */
+  std::vector<EncodeJob> jobs;
+  std::vector<size_t> channel_jobs(num_channels, SIZE_MAX);
+  std::vector<uint64_t> channel_lengths(num_channels);
+  size_t c = 0;
+  for (const LayerRecord &record : layers.layer_records) {
+    for (const ChannelInfo &info : record.channel_info) {
+      if (modified[c]) {
+        channel_jobs[c] = jobs.size();
+        jobs.push_back(make_channel_job(record, info, *modified[c], header, options));
+      }
+      else {
+        channel_lengths[c] = info.data_length;
+      }
+      c++;
+    }
+  }
+  if (edits.image_data) {
+    jobs.push_back(make_merged_job(*edits.image_data, header, options));
+  }
+  encode_jobs(jobs, header, options);
+  for (size_t i = 0; i < num_channels; i++) {
+    if (modified[i]) {
+      channel_lengths[i] = sizeof(uint16_t) + jobs[channel_jobs[i]].encoded_size(header);
+    }
+  }
+
+  write_leading_sections(out, psd);
+
+  uint64_t copied = 0;
+  uint64_t layer_and_mask_info = out.begin_section(psb);
+  uint64_t layer_info = out.begin_section(psb);
+  if (!layers.layer_records.empty()) {
+    write_layer_records(out, layers, channel_lengths, header);
+    for (size_t i = 0; i < num_channels;) {
+      if (modified[i]) {
+        const EncodeJob &job = jobs[channel_jobs[i]];
+        out.u16(uint16_t(job.compression));
+        write_encode_job(out, job, header);
+        i++;
+        continue;
+      }
+      /* Unmodified channels are back to back in the source, copy them in one go. */
+      uint64_t begin = layers.channel_offsets[i];
+      uint64_t end = begin + channel_lengths[i];
+      for (i++; i < num_channels && !modified[i] && layers.channel_offsets[i] == end; i++) {
+        end += channel_lengths[i];
+      }
+      out.copy_from(source, begin, end - begin);
+      copied += end - begin;
+    }
+    if ((out.size() - layer_info) % 2 != 0) {
+      out.u8(0);
+    }
+  }
+  out.end_section(layer_info, psb);
+
+  /* The global layer mask info and the additional layer info after the layer info are not kept by
+   * the reader, copy them. */
+  const SectionRange &source_section = index.layer_and_mask_info;
+  uint64_t length_size = psb ? 8 : 4;
+  uint64_t tail_begin = source_section.offset + source_section.length;
+  if (source_section.length > length_size) {
+    in.seek(source_section.offset + length_size);
+    uint64_t source_layer_info_length = psb ? in.read_be<uint64_t>() : in.read_be<uint32_t>();
+    tail_begin = in.tell() + source_layer_info_length;
+  }
+  uint64_t tail_end = source_section.offset + source_section.length;
+  if (tail_begin < tail_end) {
+    out.copy_from(source, tail_begin, tail_end - tail_begin);
+    copied += tail_end - tail_begin;
+  }
+  else {
+    out.u32(0);
+  }
+  out.end_section(layer_and_mask_info, psb);
+
+  if (edits.image_data) {
+    const EncodeJob &merged = jobs.back();
+    out.u16(uint16_t(merged.compression));
+    write_encode_job(out, merged, header);
+  }
+  else {
+    out.copy_from(source, index.image_data.offset, index.image_data.length);
+    copied += index.image_data.length;
+  }
+  PSD_TRACE_DEBUG("write",
+                  "incremental channels=%zu encoded=%zu copied=%llu bytes",
+                  num_channels,
+                  edits.channels.size(),
+                  static_cast<unsigned long long>(copied));
+}
+
+void write_psd_incremental(const std::filesystem::path &path,
+                           const ByteSource &source,
+                           const PSDFile &psd,
+                           const PSDEdits &edits,
+                           const PSDWriteOptions &options)
+{
+  /* Written next to the target and renamed over it once complete, so `path` may be the file
+   * `source` reads from and a failed save leaves it untouched. */
+  std::filesystem::path temp_path = path;
+  temp_path += ".tmp";
+  try {
+    ByteWriter out(temp_path);
+    write_psd_incremental(out, source, psd, edits, options);
+    out.finish();
+  }
+  catch (...) {
+    std::error_code error;
+    std::filesystem::remove(temp_path, error);
+    throw;
+  }
+  std::filesystem::rename(temp_path, path);
+}
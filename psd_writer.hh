@@ -0,0 +1,75 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "byte_writer.hh"
+#include "psd.hh"
+
+struct PSDWriteOptions {
+  /* When set, layer channels and blocks of merged image scanlines are encoded concurrently on
+   * this pool. RLE channels are split into blocks of scanlines too, so one large layer is spread
+   * over the threads as well. */
+  ThreadPool *thread_pool = nullptr;
+  /* Compression of every layer channel and of the merged image. Unset keeps the one each channel
+   * was read with. */
+  std::optional<Compression> compression;
+};
+
+/* Serialize a document as read by read_psd(): header, color mode data, image resources, layer
+ * records, layer channels and merged image. Channel data lengths, RLE byte counts and section
+ * lengths are computed from the encoded data, the ones stored in `psd` are ignored, so layers and
+ * channels can be edited before writing. The global layer mask info and the document level
+ * additional layer info are not kept by the reader and are written empty.
+ *
+ * Throws UnsupportedFormat if a channel does not hold the samples its rectangle needs (e.g. the
+ * document was read with PSDReadOptions::skip_channel_data), for ZIP with prediction in bitmap
+ * documents, and for RLE scanlines that compress to more than the 65535 bytes a PSD byte count
+ * can hold. */
+void write_psd(ByteWriter &out, const PSDFile &psd, const PSDWriteOptions &options = {});
+
+/* Same, creating or replacing the file at `path`. Throws std::system_error on I/O errors. */
+void write_psd(const std::filesystem::path &path,
+               const PSDFile &psd,
+               const PSDWriteOptions &options = {});
+
+/* A layer channel whose samples changed since the document was read. */
+struct ChannelEdit {
+  /* Index into LayerInfo::channel_offsets, which has the order of channel_image_data. */
+  size_t channel;
+  /* New samples covering channel_rect() of the channel, like LayerInfo::channel_image_data. */
+  const ChannelImageData *data;
+};
+
+struct PSDEdits {
+  std::vector<ChannelEdit> channels;
+  /* New merged image, nullptr when it did not change. */
+  const MergedImageData *image_data = nullptr;
+};
+
+/* Save a document read from `source` after editing a few of its channels. Only the channels in
+ * `edits` are encoded; the data of every other channel, the merged image unless it is in `edits`,
+ * and the global layer mask and additional layer info are copied from `source` with
+ * ByteWriter::copy_from(), so the cost is close to that of the edited data. The header, color mode
+ * data, image resources and layer records are written from `psd` with lengths matching the new
+ * channel data, so layer properties and names can change too.
+ *
+ * `psd` can be read with PSDReadOptions::skip_channel_data. Its layers and channels must be the
+ * ones read from `source`, in the same order; to add, remove or reorder layers use write_psd().
+ * Throws UnsupportedFormat if the header differs from the source in version, depth, size or
+ * channel count, if the channel offsets do not start where the source's channel data does or
+ * are not the running sum of the records' data lengths, and for the same reasons as write_psd(). */
+void write_psd_incremental(ByteWriter &out,
+                           const ByteSource &source,
+                           const PSDFile &psd,
+                           const PSDEdits &edits,
+                           const PSDWriteOptions &options = {});
+
+/* Same, writing to a temporary file next to `path` that replaces it once complete. `path` may be
+ * the file `source` was opened from: on POSIX systems the source keeps reading the old file. */
+void write_psd_incremental(const std::filesystem::path &path,
+                           const ByteSource &source,
+                           const PSDFile &psd,
+                           const PSDEdits &edits,
+                           const PSDWriteOptions &options = {});
@@ -0,0 +1,160 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "corpus.hh"
+
+/* Write a synthetic document, the same bytes for the same options:
+ *
+ *   psdgen [-s WIDTHxHEIGHT] [-l layers] [-L WIDTHxHEIGHT] [-d 8|16|32]
+ *          [-c raw|rle|zip|zip_prediction] [-e entropy] [-r seed] [-m] [-b] output
+ *
+ * Defaults are a 2048x2048 8-bit RLE canvas with 8 layers half its size, entropy 0.25 and seed 1.
+ * `-m` adds a user mask to every layer and `-b` writes PSB, which is also picked when the canvas
+ * is wider or taller than PSD allows. Pixels are generated while they are written, so stress
+ * files of many gigabytes take little memory, e.g. about 10 GB:
+ *
+ *   psdgen -s 60000x60000 -l 4 -c raw big.psb */
+
+static const char *const USAGE =
+    "usage: psdgen [-s WIDTHxHEIGHT] [-l layers] [-L WIDTHxHEIGHT] [-d 8|16|32]\n"
+    "              [-c raw|rle|zip|zip_prediction] [-e entropy] [-r seed] [-m] [-b] output";
+
+/* Photoshop limits, PSB allows up to 300000 pixels on either side. */
+static const uint32_t PSD_MAX_SIZE = 30000;
+static const uint32_t PSB_MAX_SIZE = 300000;
+
+static bool parse_size(const char *text, uint32_t *r_width, uint32_t *r_height)
+{
+  char *end;
+  unsigned long width = std::strtoul(text, &end, 10);
+  if (end == text || (*end != 'x' && *end != 'X')) {
+    return false;
+  }
+  const char *height_text = end + 1;
+  unsigned long height = std::strtoul(height_text, &end, 10);
+  if (end == height_text || *end != '\0' || width == 0 || height == 0 || width > PSB_MAX_SIZE ||
+      height > PSB_MAX_SIZE)
+  {
+    return false;
+  }
+  *r_width = uint32_t(width);
+  *r_height = uint32_t(height);
+  return true;
+}
+
+static bool parse_compression(const char *text, Compression *r_compression)
+{
+  const std::pair<const char *, Compression> names[] = {
+      {"raw", Compression::Raw},
+      {"rle", Compression::RLE},
+      {"zip", Compression::ZIP},
+      {"zip_prediction", Compression::ZIPPrediction},
+  };
+  for (const auto &[name, compression] : names) {
+    if (strcmp(text, name) == 0) {
+      *r_compression = compression;
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  CorpusDocumentSpec spec = {"psdgen", 2048, 2048, 8, 8, 0, 0, Compression::RLE, false, 1};
+  bool layer_size_given = false;
+  const char *output = nullptr;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool valid = true;
+    if (strcmp(arg, "-m") == 0) {
+      spec.layer_masks = true;
+      continue;
+    }
+    if (strcmp(arg, "-b") == 0) {
+      spec.psb = true;
+      continue;
+    }
+    if (arg[0] != '-') {
+      valid = output == nullptr;
+      output = arg;
+    }
+    else if (value == nullptr) {
+      valid = false;
+    }
+    else if (strcmp(arg, "-s") == 0) {
+      valid = parse_size(value, &spec.width, &spec.height);
+      i++;
+    }
+    else if (strcmp(arg, "-L") == 0) {
+      valid = parse_size(value, &spec.layer_width, &spec.layer_height);
+      layer_size_given = true;
+      i++;
+    }
+    else if (strcmp(arg, "-l") == 0) {
+      long num_layers = std::atol(value);
+      /* The layer count is a signed 16-bit field. */
+      valid = num_layers >= 0 && num_layers <= 32767;
+      spec.num_layers = uint32_t(num_layers);
+      i++;
+    }
+    else if (strcmp(arg, "-d") == 0) {
+      int depth = std::atoi(value);
+      valid = depth == 8 || depth == 16 || depth == 32;
+      spec.depth = uint16_t(depth);
+      i++;
+    }
+    else if (strcmp(arg, "-c") == 0) {
+      valid = parse_compression(value, &spec.compression);
+      i++;
+    }
+    else if (strcmp(arg, "-e") == 0) {
+      spec.entropy = float(std::atof(value));
+      valid = spec.entropy >= 0.0f && spec.entropy <= 1.0f;
+      i++;
+    }
+    else if (strcmp(arg, "-r") == 0) {
+      spec.seed = uint32_t(std::strtoul(value, nullptr, 10));
+      i++;
+    }
+    else {
+      valid = false;
+    }
+    if (!valid) {
+      std::cerr << USAGE << std::endl;
+      return 1;
+    }
+  }
+  if (output == nullptr) {
+    std::cerr << USAGE << std::endl;
+    return 1;
+  }
+  if (!layer_size_given) {
+    spec.layer_width = std::max(1u, spec.width / 2);
+    spec.layer_height = std::max(1u, spec.height / 2);
+  }
+  if (spec.width > PSD_MAX_SIZE || spec.height > PSD_MAX_SIZE) {
+    spec.psb = true;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    write_corpus_document(spec, output);
+  }
+  catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double megabytes = double(std::filesystem::file_size(output)) / (1024.0 * 1024.0);
+  std::cout << std::fixed << std::setprecision(2) << output << ": " << megabytes << " MB ("
+            << (spec.psb ? "PSB" : "PSD") << ") in " << seconds << " s, "
+            << megabytes / seconds << " MB/s" << std::endl;
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include "simd.hh"
+
+#include <cstdlib>
+#include <cstring>
+
+#if PSD_SIMD_X86 && defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+static SIMDLevel detect_simd_level()
+{
+#if PSD_SIMD_X86
+#  if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return SIMDLevel::SSE2;
+  }
+  __cpuidex(info, 7, 0);
+  bool has_avx2 = (info[1] & (1 << 5)) != 0;
+  /* The OS must also save the YMM registers. */
+  __cpuid(info, 1);
+  bool has_osxsave = (info[2] & (1 << 27)) != 0;
+  if (has_avx2 && has_osxsave && (_xgetbv(0) & 0x6) == 0x6) {
+    return SIMDLevel::AVX2;
+  }
+  return SIMDLevel::SSE2;
+#  else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMDLevel::AVX2;
+  }
+  return SIMDLevel::SSE2;
+#  endif
+#else
+  return SIMDLevel::Scalar;
+#endif
+}
+
+SIMDLevel simd_level()
+{
+  static const SIMDLevel level = [] {
+    SIMDLevel detected = detect_simd_level();
+    const char *cap = std::getenv("PSD_SIMD");
+    if (cap == nullptr) {
+      return detected;
+    }
+    SIMDLevel requested = detected;
+    if (strcmp(cap, "scalar") == 0) {
+      requested = SIMDLevel::Scalar;
+    }
+    else if (strcmp(cap, "sse2") == 0) {
+      requested = SIMDLevel::SSE2;
+    }
+    else if (strcmp(cap, "avx2") == 0) {
+      requested = SIMDLevel::AVX2;
+    }
+    return requested < detected ? requested : detected;
+  }();
+  return level;
+}
+
+const char *simd_level_name(SIMDLevel level)
+{
+  switch (level) {
+    case SIMDLevel::Scalar:
+      return "scalar";
+    case SIMDLevel::SSE2:
+      return "sse2";
+    case SIMDLevel::AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
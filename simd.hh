@@ -0,0 +1,29 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define PSD_SIMD_X86 1
+#  include <immintrin.h>
+#else
+#  define PSD_SIMD_X86 0
+#endif
+
+/* Functions using AVX2 intrinsics are compiled with this attribute and only called after
+ * checking simd_level() at runtime. MSVC allows the intrinsics without it. */
+#if PSD_SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#  define PSD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#  define PSD_TARGET_AVX2
+#endif
+
+enum class SIMDLevel {
+  Scalar = 0,
+  SSE2 = 1,
+  AVX2 = 2,
+};
+
+/* Best instruction set supported by the running CPU, detected once. Setting the environment
+ * variable PSD_SIMD to "scalar", "sse2" or "avx2" caps the level, which is useful to compare
+ * kernels. */
+SIMDLevel simd_level();
+
+const char *simd_level_name(SIMDLevel level);
@@ -0,0 +1,131 @@
+#include "thread_pool.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned num_threads)
+{
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  workers_.reserve(num_threads);
+  for (unsigned i = 0; i < num_threads; i++) {
+    workers_.emplace_back([this] { worker_main(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_available_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::push(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  task_available_.notify_one();
+}
+
+void ThreadPool::worker_main()
+{
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_available_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+namespace {
+
+/* Shared between the caller of parallel_for() and its helper tasks. Helpers may start after the
+ * loop is finished and the caller returned, so the state is reference counted. */
+struct ParallelForState {
+  const std::function<void(size_t)> *fn;
+  size_t count;
+  std::atomic<size_t> next = 0;
+  std::mutex mutex;
+  std::condition_variable done;
+  int active_helpers = 0;
+  std::exception_ptr exception;
+
+  void run()
+  {
+    size_t i;
+    while ((i = next.fetch_add(1)) < count) {
+      try {
+        (*fn)(i);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!exception) {
+          exception = std::current_exception();
+        }
+        next = count;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)> &fn)
+{
+  if (count == 0) {
+    return;
+  }
+  if (count == 1 || workers_.size() <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  auto state = std::make_shared<ParallelForState>();
+  state->fn = &fn;
+  state->count = count;
+
+  size_t num_helpers = std::min(count - 1, workers_.size());
+  for (size_t i = 0; i < num_helpers; i++) {
+    push([state] {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->next >= state->count) {
+          /* Started too late, `fn` may already be gone. */
+          return;
+        }
+        state->active_helpers++;
+      }
+      state->run();
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->active_helpers--;
+      state->done.notify_all();
+    });
+  }
+
+  state->run();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done.wait(lock, [&] { return state->active_helpers == 0; });
+  if (state->exception) {
+    std::rethrow_exception(state->exception);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads. */
+class ThreadPool {
+ public:
+  /* Zero picks the number of hardware threads. */
+  explicit ThreadPool(unsigned num_threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned num_threads() const
+  {
+    return unsigned(workers_.size());
+  }
+
+  /* Call `fn(i)` for every i in [0, count) and wait for all of them. The calling thread takes
+   * part, so this can be nested inside tasks. The first exception thrown by `fn` stops the
+   * remaining iterations and is rethrown here. */
+  void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+ private:
+  void push(std::function<void()> task);
+  void worker_main();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  bool stopping_ = false;
+};
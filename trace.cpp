@@ -0,0 +1,40 @@
+#include "trace.hh"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const char *level_names[] = {"none", "error", "warn", "info", "debug"};
+
+static int runtime_trace_level()
+{
+  static const int level = [] {
+    const char *env = std::getenv("PSD_TRACE");
+    if (env != nullptr) {
+      for (int i = PSD_TRACE_LEVEL_NONE; i <= PSD_TRACE_LEVEL_DEBUG; i++) {
+        if (strcmp(env, level_names[i]) == 0) {
+          return i;
+        }
+      }
+    }
+    return PSD_TRACE_LEVEL_WARN;
+  }();
+  return level;
+}
+
+bool trace_enabled(int level)
+{
+  return level <= runtime_trace_level();
+}
+
+void trace_message(int level, const char *category, const char *format, ...)
+{
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  /* A single call so lines from different threads do not interleave. */
+  fprintf(stderr, "psd %s [%s] %s\n", level_names[level], category, message);
+}
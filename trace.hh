@@ -0,0 +1,46 @@
+#pragma once
+
+/* Diagnostic tracing for the parser.
+ *
+ * Messages above PSD_TRACE_LEVEL are removed at compile time: the arguments are still type
+ * checked but never evaluated, so release builds pay nothing on the hot paths. Messages that are
+ * compiled in are filtered at runtime by the PSD_TRACE environment variable ("error", "warn",
+ * "info" or "debug", default "warn") and written to stderr as one line each:
+ *
+ *   psd debug [channel] compression=1 size=4096
+ */
+
+#define PSD_TRACE_LEVEL_NONE 0
+#define PSD_TRACE_LEVEL_ERROR 1
+#define PSD_TRACE_LEVEL_WARN 2
+#define PSD_TRACE_LEVEL_INFO 3
+#define PSD_TRACE_LEVEL_DEBUG 4
+
+#ifndef PSD_TRACE_LEVEL
+#  ifdef NDEBUG
+#    define PSD_TRACE_LEVEL PSD_TRACE_LEVEL_NONE
+#  else
+#    define PSD_TRACE_LEVEL PSD_TRACE_LEVEL_DEBUG
+#  endif
+#endif
+
+bool trace_enabled(int level);
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 3, 4)))
+#endif
+void trace_message(int level, const char *category, const char *format, ...);
+
+#define PSD_TRACE(level, category, ...) \
+  do { \
+    if constexpr (PSD_TRACE_LEVEL_##level <= PSD_TRACE_LEVEL) { \
+      if (trace_enabled(PSD_TRACE_LEVEL_##level)) { \
+        trace_message(PSD_TRACE_LEVEL_##level, category, __VA_ARGS__); \
+      } \
+    } \
+  } while (0)
+
+#define PSD_TRACE_ERROR(category, ...) PSD_TRACE(ERROR, category, __VA_ARGS__)
+#define PSD_TRACE_WARN(category, ...) PSD_TRACE(WARN, category, __VA_ARGS__)
+#define PSD_TRACE_INFO(category, ...) PSD_TRACE(INFO, category, __VA_ARGS__)
+#define PSD_TRACE_DEBUG(category, ...) PSD_TRACE(DEBUG, category, __VA_ARGS__)
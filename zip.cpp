@@ -0,0 +1,105 @@
+#include "zip.hh"
+
+#include <algorithm>
+#include <limits>
+
+#include <zlib.h>
+
+bool zip_decompress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
+{
+  z_stream stream = {};
+  if (inflateInit(&stream) != Z_OK) {
+    return false;
+  }
+  /* zlib counts in uInt, feed buffers larger than that in pieces. */
+  constexpr size_t max_chunk = std::numeric_limits<uInt>::max();
+  int result = Z_OK;
+  while (result == Z_OK) {
+    if (stream.avail_in == 0 && src_size > 0) {
+      stream.next_in = const_cast<Bytef *>(src);
+      stream.avail_in = uInt(std::min(src_size, max_chunk));
+      src += stream.avail_in;
+      src_size -= stream.avail_in;
+    }
+    if (stream.avail_out == 0 && dst_size > 0) {
+      stream.next_out = dst;
+      stream.avail_out = uInt(std::min(dst_size, max_chunk));
+      dst += stream.avail_out;
+      dst_size -= stream.avail_out;
+    }
+    result = inflate(&stream, Z_NO_FLUSH);
+    if (result == Z_BUF_ERROR && (stream.avail_in > 0 || src_size > 0) &&
+        (stream.avail_out > 0 || dst_size > 0))
+    {
+      result = Z_OK;
+    }
+  }
+  bool filled = stream.avail_out == 0 && dst_size == 0;
+  inflateEnd(&stream);
+  return result == Z_STREAM_END && filled;
+}
+
+bool zip_compress(std::vector<uint8_t> &r_dst, const uint8_t *src, size_t src_size, int level)
+{
+  ZipCompressor compressor(level);
+  r_dst.clear();
+  return compressor.compress(r_dst, src, src_size, true);
+}
+
+ZipCompressor::ZipCompressor(int level) : stream_(std::make_unique<z_stream>())
+{
+  valid_ = deflateInit(stream_.get(), level) == Z_OK;
+}
+
+ZipCompressor::~ZipCompressor()
+{
+  if (valid_) {
+    deflateEnd(stream_.get());
+  }
+}
+
+bool ZipCompressor::compress(std::vector<uint8_t> &r_dst,
+                             const uint8_t *src,
+                             size_t src_size,
+                             bool finish)
+{
+  if (!valid_) {
+    return false;
+  }
+  z_stream &stream = *stream_;
+  constexpr size_t max_chunk = std::numeric_limits<uInt>::max();
+  size_t written = r_dst.size();
+  r_dst.resize(written + deflateBound(&stream, uLong(std::min(src_size, max_chunk))));
+  int result = Z_OK;
+  for (;;) {
+    if (stream.avail_in == 0 && src_size > 0) {
+      stream.next_in = const_cast<Bytef *>(src);
+      stream.avail_in = uInt(std::min(src_size, max_chunk));
+      src += stream.avail_in;
+      src_size -= stream.avail_in;
+    }
+    if (written == r_dst.size()) {
+      r_dst.resize(r_dst.size() * 2);
+    }
+    stream.next_out = r_dst.data() + written;
+    stream.avail_out = uInt(std::min(r_dst.size() - written, max_chunk));
+    size_t avail_out = stream.avail_out;
+    result = deflate(&stream, finish && src_size == 0 ? Z_FINISH : Z_NO_FLUSH);
+    written += avail_out - stream.avail_out;
+    if (result != Z_OK) {
+      break;
+    }
+    /* All input is consumed and there was room for more output. zlib keeps what it has not
+     * emitted yet for the next call. */
+    if (!finish && stream.avail_in == 0 && src_size == 0 && stream.avail_out > 0) {
+      break;
+    }
+  }
+  r_dst.resize(written);
+  bool success = finish ? result == Z_STREAM_END : result == Z_OK;
+  if (finish || !success) {
+    deflateEnd(&stream);
+    valid_ = false;
+  }
+  return success;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct z_stream_s;
+
+/* Inflate a zlib stream of `src_size` bytes into exactly `dst_size` bytes. Returns false if the
+ * stream is corrupt or does not decompress to `dst_size` bytes. */
+bool zip_decompress(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size);
+
+/* Deflate `src_size` bytes into a zlib stream, replacing the contents of `r_dst`. Returns false
+ * if zlib fails. */
+bool zip_compress(std::vector<uint8_t> &r_dst, const uint8_t *src, size_t src_size, int level = 6);
+
+/* Deflates one zlib stream fed in pieces, for data too large to hold at once. */
+class ZipCompressor {
+ public:
+  explicit ZipCompressor(int level = 6);
+  ~ZipCompressor();
+
+  ZipCompressor(const ZipCompressor &) = delete;
+  ZipCompressor &operator=(const ZipCompressor &) = delete;
+
+  /* Compress `src_size` more bytes and append the output produced so far to `r_dst`. Pass
+   * `finish` with the last piece to end the stream. Returns false if zlib fails. */
+  bool compress(std::vector<uint8_t> &r_dst, const uint8_t *src, size_t src_size, bool finish);
+
+ private:
+  std::unique_ptr<z_stream_s> stream_;
+  bool valid_;
+};